@@ -0,0 +1,204 @@
+#ifndef COMMON_BENCH_H_
+#define COMMON_BENCH_H_
+
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <caffe/caffe.hpp>
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include "common/image_files.h"
+
+/* Throughput and latency benchmark of the file tools' --bench mode. */
+
+struct BenchOptions {
+  int images;          // timed per configuration
+  int warmup;          // untimed batches per thread before a configuration
+  int max_batch;       // largest batch size swept
+  int max_threads;     // largest thread count swept
+  std::string output;  // JSON lines file the results are appended to
+};
+
+/* Fixed set of synthetic 640x480 BGR frames, identical from run to run. */
+static std::vector<cv::Mat> SyntheticImages(int count) {
+  std::vector<cv::Mat> images;
+  cv::RNG rng(12345);
+  for (int i = 0; i < count; ++i) {
+    cv::Mat img(480, 640, CV_8UC3);
+    rng.fill(img, cv::RNG::UNIFORM, 0, 256);
+    images.push_back(img);
+  }
+  return images;
+}
+
+/* The image set of a benchmark or an int8 report: synthetic images, a
+ * directory, a list file or a single image. */
+static std::vector<cv::Mat> LoadBenchImages(const std::string& source) {
+  if (source == "SYNTHETIC")
+    return SyntheticImages(16);
+
+  std::vector<std::string> files(1, source);
+  struct stat st;
+  CHECK_EQ(stat(source.c_str(), &st), 0) << "Unable to stat " << source;
+  if (S_ISDIR(st.st_mode))
+    files = ListDirectory(source);
+  else if (!HasImageExtension(source))
+    files = ReadFileList(source);
+
+  std::vector<cv::Mat> images;
+  for (size_t i = 0; i < files.size(); ++i) {
+    cv::Mat img = cv::imread(files[i], -1);
+    if (img.empty())
+      LOG(WARNING) << "Unable to decode image " << files[i];
+    else
+      images.push_back(img);
+  }
+  return images;
+}
+
+/* max_threads, or the number of cores if it is not positive. */
+static int BenchMaxThreads(int max_threads) {
+  if (max_threads > 0)
+    return max_threads;
+  return std::max<int>(std::thread::hardware_concurrency(), 1);
+}
+
+/* 1, 2, 4, ... and finally max_value itself. */
+static std::vector<int> BenchSteps(int max_value) {
+  std::vector<int> steps;
+  for (int v = 1; v < max_value; v *= 2)
+    steps.push_back(v);
+  steps.push_back(std::max(max_value, 1));
+  return steps;
+}
+
+/* Processes one batch of images with the engine under test. */
+typedef std::function<void(const std::vector<cv::Mat>&)> BenchFunction;
+
+struct BenchResult {
+  int images;
+  double seconds;
+  std::vector<double> latency_ms;  // per batch, sorted
+};
+
+/* Run fn on options.images images in batches of batch_size from
+ * num_threads threads, after options.warmup untimed batches per thread.
+ * Images are taken round robin from the image set. */
+static BenchResult RunBenchConfig(const std::vector<cv::Mat>& images,
+                                  const BenchFunction& fn,
+                                  const BenchOptions& options,
+                                  int batch_size, int num_threads) {
+  const int num_batches = std::max(options.images / batch_size, 1);
+  std::atomic<int> next_batch(0);
+  std::vector<std::vector<double> > latency(num_threads);
+
+  auto worker = [&](int t, bool warmup) {
+    std::vector<cv::Mat> batch(batch_size);
+    for (int n = 0;; ++n) {
+      int b = warmup ? n : next_batch++;
+      if (b >= (warmup ? options.warmup : num_batches))
+        break;
+      for (int i = 0; i < batch_size; ++i)
+        batch[i] = images[(b * batch_size + i) % images.size()];
+      std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+      fn(batch);
+      if (!warmup)
+        latency[t].push_back(std::chrono::duration<double, std::milli>(
+          std::chrono::steady_clock::now() - start).count());
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t)
+    threads.push_back(std::thread(worker, t, true));
+  for (int t = 0; t < num_threads; ++t)
+    threads[t].join();
+
+  threads.clear();
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+  for (int t = 0; t < num_threads; ++t)
+    threads.push_back(std::thread(worker, t, false));
+  for (int t = 0; t < num_threads; ++t)
+    threads[t].join();
+
+  BenchResult result;
+  result.seconds = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+  result.images = num_batches * batch_size;
+  for (int t = 0; t < num_threads; ++t)
+    result.latency_ms.insert(result.latency_ms.end(),
+                             latency[t].begin(), latency[t].end());
+  std::sort(result.latency_ms.begin(), result.latency_ms.end());
+  return result;
+}
+
+static double BenchPercentile(const std::vector<double>& sorted, double p) {
+  if (sorted.empty())
+    return 0;
+  size_t rank = std::ceil(p * sorted.size());
+  return sorted[std::min(std::max<size_t>(rank, 1), sorted.size()) - 1];
+}
+
+/* Measure throughput and per-batch latency of fn for every combination
+ * of thread count and batch size up to the maxima of options. A table goes
+ * to standard output and one JSON object per configuration is appended to
+ * options.output. */
+static void Benchmark(const std::string& engine, const std::string& model_file,
+                      const std::vector<cv::Mat>& images,
+                      const BenchFunction& fn, const BenchOptions& options) {
+  CHECK(!images.empty()) << "No images to benchmark with.";
+  std::ofstream json(options.output.c_str(), std::ios::app);
+  CHECK(json) << "Unable to open " << options.output;
+
+  std::cout << engine << " benchmark of " << model_file << " on "
+            << images.size() << " images" << std::endl;
+  std::cout << std::setw(8) << "threads" << std::setw(8) << "batch"
+            << std::setw(12) << "images/s" << std::setw(10) << "p50 ms"
+            << std::setw(10) << "p95 ms" << std::setw(10) << "p99 ms"
+            << std::endl;
+
+  std::vector<int> thread_steps = BenchSteps(options.max_threads);
+  std::vector<int> batch_steps = BenchSteps(options.max_batch);
+  for (size_t t = 0; t < thread_steps.size(); ++t) {
+    for (size_t b = 0; b < batch_steps.size(); ++b) {
+      BenchResult r = RunBenchConfig(images, fn, options, batch_steps[b],
+                                     thread_steps[t]);
+      const double rate = r.images / r.seconds;
+      const double p50 = BenchPercentile(r.latency_ms, 0.50);
+      const double p95 = BenchPercentile(r.latency_ms, 0.95);
+      const double p99 = BenchPercentile(r.latency_ms, 0.99);
+
+      std::cout << std::fixed << std::setprecision(2)
+                << std::setw(8) << thread_steps[t]
+                << std::setw(8) << batch_steps[b]
+                << std::setw(12) << rate << std::setw(10) << p50
+                << std::setw(10) << p95 << std::setw(10) << p99
+                << std::endl;
+      json << std::fixed << std::setprecision(3)
+           << "{\"engine\":\"" << engine << "\""
+           << ",\"model\":\"" << model_file << "\""
+           << ",\"threads\":" << thread_steps[t]
+           << ",\"batch\":" << batch_steps[b]
+           << ",\"images\":" << r.images
+           << ",\"seconds\":" << r.seconds
+           << ",\"images_per_sec\":" << rate
+           << ",\"latency_ms\":{\"p50\":" << p50 << ",\"p95\":" << p95
+           << ",\"p99\":" << p99 << "}}\n";
+    }
+  }
+}
+
+#endif  // COMMON_BENCH_H_
@@ -0,0 +1,254 @@
+#ifndef COMMON_DATASET_INDEX_H_
+#define COMMON_DATASET_INDEX_H_
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+static const char kManifestMagic[4] = { 'M', 'A', 'N', '1' };
+
+/* Persistent index of a training set that pairs every image with the
+ * label file of the same stem. It is kept as <image dir>/.manifest and
+ * read through mmap, so that opening a set of millions of samples needs
+ * neither a directory scan nor a sort. The manifest is rebuilt only when
+ * either directory changed since it was written: samples already indexed
+ * keep their order and new ones are appended sorted by name. Delete puts a
+ * tombstone on a sample in place, so no other index ever shifts.
+ *
+ * A manifest is the magic "MAN1", the uint32 number of samples and the
+ * uint64 modification times in ns of the image and label directories,
+ * then per sample the uint32 offsets of its image and label file names in
+ * the name table and a uint32 tombstone flag, then the name table of
+ * NUL-terminated names. Images without a label file are paired with the
+ * .txt file of their stem, which is created when the sample is saved;
+ * call Stamp after saving so that the new file doesn't trigger a rebuild.
+ * A manifest whose records point outside its name table is rebuilt. */
+class DatasetIndex {
+ public:
+  DatasetIndex()
+    : data_(NULL), size_(0), header_(NULL), records_(NULL), names_(NULL) {}
+
+  ~DatasetIndex() { Unmap(); }
+
+  bool Open(const std::string& image_dir, const std::string& label_dir) {
+    image_dir_ = image_dir;
+    label_dir_ = label_dir;
+    path_ = image_dir + "/.manifest";
+    if (Map() && header_->image_mtime == Mtime(image_dir_) &&
+        header_->label_mtime == Mtime(label_dir_))
+      return true;
+    if (!Rebuild() || !Map())
+      return false;
+    Stamp();
+    return true;
+  }
+
+  size_t size() const { return header_ ? header_->count : 0; }
+
+  bool deleted(size_t index) const { return records_[index].deleted != 0; }
+
+  std::string image(size_t index) const {
+    return names_ + records_[index].image;
+  }
+
+  std::string label(size_t index) const {
+    return names_ + records_[index].label;
+  }
+
+  /* Index of the nearest sample after (step 1) or before (step -1) index
+   * that is not deleted, or -1 if there is none. */
+  int Next(int index, int step) const {
+    for (int i = index + step; i >= 0 && i < (int) size(); i += step)
+      if (!deleted(i))
+        return i;
+    return -1;
+  }
+
+  /* Mark a sample deleted once its files have been removed. */
+  void Delete(size_t index) {
+    records_[index].deleted = 1;
+    Stamp();
+  }
+
+  /* Record the current directory times, so that changes made through
+   * this index, such as deleted samples or label files created on save,
+   * do not cause a rebuild on the next Open. */
+  void Stamp() {
+    header_->image_mtime = Mtime(image_dir_);
+    header_->label_mtime = Mtime(label_dir_);
+    msync(data_, size_, MS_ASYNC);
+  }
+
+ private:
+  struct Header {
+    char magic[4];
+    uint32_t count;
+    uint64_t image_mtime;
+    uint64_t label_mtime;
+  };
+
+  struct Record {
+    uint32_t image;
+    uint32_t label;
+    uint32_t deleted;
+  };
+
+  static uint64_t Mtime(const std::string& dir) {
+    struct stat st;
+    if (stat(dir.c_str(), &st) != 0)
+      return 0;
+    return (uint64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  }
+
+  static std::string Stem(const std::string& name) {
+    return name.substr(0, name.find_last_of('.'));
+  }
+
+  /* Names in dir, skipping hidden entries such as "." and the manifest. */
+  static bool List(const std::string& dir, std::vector<std::string>* names) {
+    DIR* dp = opendir(dir.c_str());
+    if (dp == NULL) {
+      std::cout << "Error(" << errno << ") opening " << dir << std::endl;
+      return false;
+    }
+    struct dirent* dirp;
+    while ((dirp = readdir(dp)) != NULL)
+      if (dirp->d_name[0] != '.')
+        names->push_back(dirp->d_name);
+    closedir(dp);
+    return true;
+  }
+
+  bool Map() {
+    Unmap();
+    int fd = open(path_.c_str(), O_RDWR);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(Header)) {
+      close(fd);
+      return false;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+      return false;
+    data_ = static_cast<char*>(data);
+    size_ = st.st_size;
+    header_ = reinterpret_cast<Header*>(data_);
+    records_ = reinterpret_cast<Record*>(data_ + sizeof(Header));
+
+    /* A manifest that is truncated or whose records point outside the
+     * name table is not used, so Open rebuilds it. */
+    const uint64_t names_offset =
+      sizeof(Header) + (uint64_t) header_->count * sizeof(Record);
+    bool valid =
+      memcmp(header_->magic, kManifestMagic, sizeof(kManifestMagic)) == 0 &&
+      names_offset <= size_ &&
+      (header_->count == 0 || data_[size_ - 1] == '\0');
+    const size_t names_size = valid ? size_ - names_offset : 0;
+    for (uint32_t i = 0; valid && i < header_->count; ++i)
+      valid = records_[i].image < names_size &&
+              records_[i].label < names_size;
+    if (!valid) {
+      Unmap();
+      return false;
+    }
+    names_ = data_ + names_offset;
+    return true;
+  }
+
+  void Unmap() {
+    if (data_)
+      munmap(data_, size_);
+    data_ = NULL;
+    size_ = 0;
+    header_ = NULL;
+    records_ = NULL;
+    names_ = NULL;
+  }
+
+  bool Rebuild() {
+    std::vector<std::string> images, label_names;
+    if (!List(image_dir_, &images) || !List(label_dir_, &label_names))
+      return false;
+    std::unordered_map<std::string, std::string> labels;
+    for (size_t i = 0; i < label_names.size(); ++i)
+      labels[Stem(label_names[i])] = label_names[i];
+
+    // keep the samples of the current manifest in place, then add new ones
+    std::unordered_set<std::string> present(images.begin(), images.end());
+    std::unordered_set<std::string> indexed;
+    std::vector<std::string> samples;
+    for (size_t i = 0; i < size(); ++i) {
+      if (!deleted(i) && present.count(image(i))) {
+        samples.push_back(image(i));
+        indexed.insert(image(i));
+      }
+    }
+    const size_t kept = samples.size();
+    for (size_t i = 0; i < images.size(); ++i)
+      if (!indexed.count(images[i]))
+        samples.push_back(images[i]);
+    std::sort(samples.begin() + kept, samples.end());
+    Unmap();
+
+    Header header;
+    memcpy(header.magic, kManifestMagic, sizeof(kManifestMagic));
+    header.count = samples.size();
+    header.image_mtime = 0;
+    header.label_mtime = 0;
+    std::vector<Record> records(samples.size());
+    std::string names;
+    for (size_t i = 0; i < samples.size(); ++i) {
+      std::unordered_map<std::string, std::string>::const_iterator label =
+        labels.find(Stem(samples[i]));
+      records[i].image = names.size();
+      names.append(samples[i].c_str(), samples[i].size() + 1);
+      records[i].label = names.size();
+      const std::string label_name = label != labels.end()
+                                ? label->second : Stem(samples[i]) + ".txt";
+      names.append(label_name.c_str(), label_name.size() + 1);
+      records[i].deleted = 0;
+    }
+
+    // write a new manifest next to the old one and swap it in
+    const std::string temp = path_ + ".tmp";
+    std::ofstream file(temp.c_str(), std::ios::out | std::ios::binary);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(records.data()),
+               records.size() * sizeof(Record));
+    file.write(names.data(), names.size());
+    file.close();
+    if (file.fail() || rename(temp.c_str(), path_.c_str()) != 0) {
+      std::cout << "Unable to write " << path_ << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  std::string image_dir_;
+  std::string label_dir_;
+  std::string path_;
+  char* data_;
+  size_t size_;
+  Header* header_;
+  Record* records_;
+  const char* names_;
+};
+
+#endif  // COMMON_DATASET_INDEX_H_
@@ -0,0 +1,167 @@
+#ifndef COMMON_EXPORT_WRITER_H_
+#define COMMON_EXPORT_WRITER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "boost/filesystem.hpp"
+#include "opencv2/opencv.hpp"
+
+#include "common/lmdb_writer.h"
+#include "common/shard.h"
+
+/* Writes exported training samples from a pool of background threads, so
+ * that JPEG encoding and disk writes never hold up frame grabbing or mouse
+ * handling. Samples go to an image and a txt file each, or to shards
+ * and/or LMDBs if given. Push never blocks: when the bounded queue is full
+ * the sample is dropped and counted. Output folders that have gone
+ * missing are created again by the writer threads. Samples that still
+ * can't be written are counted as failed; the writer threads never print,
+ * the UI thread reports the counters. */
+class ExportWriter {
+ public:
+  ExportWriter(size_t capacity, int num_threads, ShardWriter* shards = NULL,
+               LmdbWriter* lmdb = NULL)
+    : capacity_(capacity), shards_(shards), lmdb_(lmdb), stop_(false),
+      written_(0), dropped_(0), failed_(0) {
+    for (int i = 0; i < num_threads; ++i)
+      threads_.push_back(std::thread(&ExportWriter::Run, this));
+  }
+
+  ~ExportWriter() { Close(); }
+
+  /* Queue a copy of image together with the contents of its label file.
+   * Return false if the sample was dropped. */
+  bool Push(const std::string& image_file, const cv::Mat& image,
+            const std::string& label_file, const std::string& labels) {
+    /* The capture loop reuses its frame buffer, so the image is copied
+     * before it is queued, outside the lock. */
+    Sample sample = { image_file, image.clone(), label_file, labels };
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (queue_.size() >= capacity_) {
+        ++dropped_;
+        return false;
+      }
+      queue_.push_back(std::move(sample));
+    }
+    cond_.notify_one();
+    return true;
+  }
+
+  /* Write out the queued samples and stop the writer threads. */
+  void Close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cond_.notify_all();
+    for (size_t i = 0; i < threads_.size(); ++i)
+      threads_[i].join();
+    threads_.clear();
+  }
+
+  size_t depth() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queue_.size();
+  }
+
+  size_t written() const { return written_; }
+
+  size_t dropped() const { return dropped_; }
+
+  size_t failed() const { return failed_; }
+
+  /* Image file of the last sample that failed, empty if none did. */
+  std::string last_failure() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return last_failure_;
+  }
+
+ private:
+  struct Sample {
+    std::string image_file;
+    cv::Mat image;
+    std::string label_file;
+    std::string labels;
+  };
+
+  void Run() {
+    for (;;) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+      if (queue_.empty())
+        return;
+      Sample sample = std::move(queue_.front());
+      queue_.pop_front();
+      lock.unlock();
+
+      if (Write(sample)) {
+        ++written_;
+      } else {
+        lock.lock();
+        last_failure_ = sample.image_file;
+        ++failed_;
+      }
+    }
+  }
+
+  bool Write(const Sample& sample) {
+    if (shards_ || lmdb_) {
+      const boost::filesystem::path path(sample.image_file);
+      std::vector<uchar> image;
+      if (!cv::imencode(path.extension().string(), sample.image, image))
+        return false;
+      if (lmdb_)
+        lmdb_->Put(path.stem().string(), image, sample.image.rows,
+                   sample.image.cols, sample.image.channels(), sample.labels);
+      if (!shards_)
+        return true;
+      ShardRecord record;
+      record.name = path.filename().string();
+      record.image.assign(image.begin(), image.end());
+      record.labels = EncodeLabels(sample.labels);
+      return shards_->Append(record);
+    }
+
+    for (int attempt = 0; attempt < 2; ++attempt) {
+      if (attempt > 0) {
+        boost::system::error_code error;
+        boost::filesystem::create_directories(
+          boost::filesystem::path(sample.image_file).parent_path(), error);
+        boost::filesystem::create_directories(
+          boost::filesystem::path(sample.label_file).parent_path(), error);
+      }
+      if (!cv::imwrite(sample.image_file, sample.image))
+        continue;
+      std::ofstream outFile(sample.label_file.c_str());
+      outFile << sample.labels;
+      outFile.close();
+      if (!outFile.fail())
+        return true;
+    }
+    return false;
+  }
+
+  std::deque<Sample> queue_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::vector<std::thread> threads_;
+  size_t capacity_;
+  ShardWriter* shards_;
+  LmdbWriter* lmdb_;
+  bool stop_;
+  std::atomic<size_t> written_;
+  std::atomic<size_t> dropped_;
+  std::atomic<size_t> failed_;
+  std::string last_failure_;
+};
+
+#endif  // COMMON_EXPORT_WRITER_H_
@@ -0,0 +1,214 @@
+#ifndef COMMON_FOLD_LAYERS_H_
+#define COMMON_FOLD_LAYERS_H_
+
+#include <stdint.h>
+#include <cmath>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <caffe/caffe.hpp>
+
+/* Turn the BatchNorm and Scale layers directly following a convolution
+ * into a per-channel scale and shift of its output, as long as nothing
+ * else reads the intermediate blobs. Return the index of the last layer
+ * folded, or i if there is none. */
+static int FoldChain(const caffe::NetParameter& param, int i,
+                     caffe::Net<float>* net, std::vector<float>* scale,
+                     std::vector<float>* shift, std::string* top) {
+  const caffe::LayerParameter& conv = param.layer(i);
+  const int channels = net->layer_by_name(conv.name())->blobs()[0]->shape(0);
+  scale->assign(channels, 1.f);
+  shift->assign(channels, 0.f);
+  *top = conv.top(0);
+
+  int last = i;
+  for (int j = i + 1; j < param.layer_size(); ++j) {
+    const caffe::LayerParameter& layer = param.layer(j);
+    if (layer.bottom_size() != 1 || layer.top_size() != 1 ||
+        layer.bottom(0) != *top)
+      break;
+    if (layer.type() != "BatchNorm" && layer.type() != "Scale")
+      break;
+
+    /* An out-of-place BatchNorm or Scale leaves its input readable by
+     * later layers, which folding would break. */
+    if (layer.top(0) != *top) {
+      int readers = 0;
+      for (int k = j + 1; k < param.layer_size(); ++k)
+        for (int b = 0; b < param.layer(k).bottom_size(); ++b)
+          if (param.layer(k).bottom(b) == *top)
+            ++readers;
+      if (readers)
+        break;
+    }
+
+    const std::vector<caffe::shared_ptr<caffe::Blob<float> > >& blobs =
+      net->layer_by_name(layer.name())->blobs();
+    if (layer.type() == "BatchNorm") {
+      const caffe::BatchNormParameter& bn = layer.batch_norm_param();
+      if (bn.has_use_global_stats() && !bn.use_global_stats())
+        break;
+      /* Caffe stores the running sums together with their weight. */
+      const float weight = blobs[2]->cpu_data()[0];
+      const float factor = weight == 0 ? 0 : 1 / weight;
+      const float* mean = blobs[0]->cpu_data();
+      const float* variance = blobs[1]->cpu_data();
+      for (int c = 0; c < channels; ++c) {
+        const float s = 1 / std::sqrt(variance[c] * factor + bn.eps());
+        (*shift)[c] = ((*shift)[c] - mean[c] * factor) * s;
+        (*scale)[c] *= s;
+      }
+    } else {
+      if (blobs.empty() || blobs[0]->count() != channels)
+        break;
+      const float* gamma = blobs[0]->cpu_data();
+      const float* beta =
+        layer.scale_param().bias_term() ? blobs[1]->cpu_data() : NULL;
+      for (int c = 0; c < channels; ++c) {
+        (*scale)[c] *= gamma[c];
+        (*shift)[c] = (*shift)[c] * gamma[c] + (beta ? beta[c] : 0);
+      }
+    }
+    *top = layer.top(0);
+    last = j;
+  }
+  return last;
+}
+
+/* Run a ReLU in place when nothing after it reads its input, renaming
+ * its output blob to the input blob for the layers that follow. */
+static bool MakeReLUInPlace(caffe::NetParameter* param, int i) {
+  caffe::LayerParameter* relu = param->mutable_layer(i);
+  if (relu->bottom_size() != 1 || relu->top_size() != 1 ||
+      relu->bottom(0) == relu->top(0))
+    return false;
+  const std::string input = relu->bottom(0);
+  const std::string output = relu->top(0);
+
+  /* The output must be read later, so it is not a net output looked up
+   * by name, and the input must not be read or written again. */
+  bool output_read = false;
+  for (int k = i + 1; k < param->layer_size(); ++k) {
+    const caffe::LayerParameter& layer = param->layer(k);
+    for (int b = 0; b < layer.bottom_size(); ++b) {
+      if (layer.bottom(b) == input)
+        return false;
+      if (layer.bottom(b) == output)
+        output_read = true;
+    }
+    for (int t = 0; t < layer.top_size(); ++t)
+      if (layer.top(t) == input)
+        return false;
+  }
+  if (!output_read)
+    return false;
+
+  relu->set_top(0, input);
+  for (int k = i + 1; k < param->layer_size(); ++k) {
+    caffe::LayerParameter* layer = param->mutable_layer(k);
+    for (int b = 0; b < layer->bottom_size(); ++b)
+      if (layer->bottom(b) == output)
+        layer->set_bottom(b, input);
+    for (int t = 0; t < layer->top_size(); ++t)
+      if (layer->top(t) == output)
+        layer->set_top(t, input);
+  }
+  return true;
+}
+
+/* Rewrite of a deploy net for inference: BatchNorm and Scale layers after
+ * a convolution are folded into its weights and bias, and ReLUs run in
+ * place. Each folded layer saves a full pass over its activations and its
+ * output blob. */
+struct NetFold {
+  caffe::NetParameter param;  // the rewritten net
+  /* Per-channel scale and shift of each folded convolution. */
+  std::map<std::string, std::pair<std::vector<float>, std::vector<float> > >
+    folds;
+  int num_folded;  // BatchNorm and Scale layers folded away
+  int num_relus;   // ReLUs made in place
+  uint64_t key;    // hash of the names of the layers folded away
+
+  bool empty() const { return num_folded == 0 && num_relus == 0; }
+};
+
+/* Plan the rewrite of param, whose trained weights are held by net. The
+ * layers folded only depend on the shapes of the blobs of net, so the
+ * layout of the rewrite can be planned before the weights are loaded;
+ * the scales and shifts are only meaningful once they are. */
+static void FoldParam(const caffe::NetParameter& param,
+                      caffe::Net<float>* net, NetFold* fold) {
+  fold->param.CopyFrom(param);
+  fold->param.clear_layer();
+  fold->folds.clear();
+  fold->num_folded = 0;
+  fold->num_relus = 0;
+  fold->key = 14695981039346656037ULL;  // FNV-1a
+  for (int i = 0; i < param.layer_size(); ++i) {
+    const caffe::LayerParameter& layer = param.layer(i);
+    caffe::LayerParameter* copy = fold->param.add_layer();
+    copy->CopyFrom(layer);
+    if (layer.type() != "Convolution" || layer.top_size() != 1)
+      continue;
+    std::vector<float> scale, shift;
+    std::string top;
+    const int last = FoldChain(param, i, net, &scale, &shift, &top);
+    if (last == i)
+      continue;
+    copy->set_top(0, top);
+    copy->mutable_convolution_param()->set_bias_term(true);
+    fold->folds[layer.name()] = std::make_pair(scale, shift);
+    fold->num_folded += last - i;
+    for (int j = i + 1; j <= last; ++j) {
+      const std::string& name = param.layer(j).name();
+      for (size_t k = 0; k <= name.size(); ++k) {
+        fold->key ^= k < name.size() ? (unsigned char) name[k] : 0;
+        fold->key *= 1099511628211ULL;
+      }
+    }
+    i = last;
+  }
+
+  for (int i = 0; i < fold->param.layer_size(); ++i)
+    if (fold->param.layer(i).type() == "ReLU" &&
+        MakeReLUInPlace(&fold->param, i))
+      ++fold->num_relus;
+}
+
+/* Fill the parameter blobs of folded, built from fold.param, from the
+ * trained weights of net: layers left as they were share their weights
+ * with net, and the folded convolutions get their own. */
+static void FoldWeights(const NetFold& fold, caffe::Net<float>* net,
+                        caffe::Net<float>* folded) {
+  for (size_t i = 0; i < folded->layers().size(); ++i) {
+    const std::string& name = folded->layer_names()[i];
+    const std::vector<caffe::shared_ptr<caffe::Blob<float> > >& target =
+      folded->layers()[i]->blobs();
+    const std::vector<caffe::shared_ptr<caffe::Blob<float> > >& source =
+      net->layer_by_name(name)->blobs();
+    if (!fold.folds.count(name)) {
+      for (size_t j = 0; j < target.size(); ++j)
+        target[j]->ShareData(*source[j]);
+      continue;
+    }
+
+    /* W' = W * scale and b' = b * scale + shift, per output channel. */
+    const std::vector<float>& scale = fold.folds.find(name)->second.first;
+    const std::vector<float>& shift = fold.folds.find(name)->second.second;
+    const int channels = scale.size();
+    const int row_size = source[0]->count() / channels;
+    const float* weights = source[0]->cpu_data();
+    const float* bias = source.size() > 1 ? source[1]->cpu_data() : NULL;
+    float* folded_weights = target[0]->mutable_cpu_data();
+    float* folded_bias = target[1]->mutable_cpu_data();
+    for (int c = 0; c < channels; ++c) {
+      for (int k = 0; k < row_size; ++k)
+        folded_weights[c * row_size + k] = weights[c * row_size + k] * scale[c];
+      folded_bias[c] = (bias ? bias[c] : 0) * scale[c] + shift[c];
+    }
+  }
+}
+
+#endif  // COMMON_FOLD_LAYERS_H_
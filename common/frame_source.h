@@ -0,0 +1,209 @@
+#ifndef COMMON_FRAME_SOURCE_H_
+#define COMMON_FRAME_SOURCE_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+/* Source of frames for the capture loop: a camera, a video file or a
+ * .frames file recorded earlier. Whatever is read can be recorded to a
+ * .frames file, so a camera session can be replayed later through the
+ * same loop code, either at its original pace or as fast as possible.
+ *
+ * A .frames file is the magic "FRM1" followed by one record per frame:
+ * the capture time in microseconds since the first frame (int64), rows,
+ * cols, OpenCV type and encoding (int32 each; 0 raw, 1 JPEG), the payload
+ * size (uint32) and the payload. */
+class FrameSource {
+ public:
+  FrameSource()
+    : replay_(false), realtime_(true), record_jpeg_(true), started_(false),
+      first_timestamp_(0) {}
+
+  /* Open "VIDEO" for the default camera, a .frames file for replay or
+   * any other video file. */
+  bool Open(const std::string& source) {
+    const std::string ext = ".frames";
+    replay_ = source.size() > ext.size() &&
+              source.compare(source.size() - ext.size(), ext.size(),
+                             ext) == 0;
+    if (!replay_) {
+      if (source == "VIDEO")
+        capture_.open(0);
+      else
+        capture_.open(source);
+      return capture_.isOpened();
+    }
+
+    replay_file_.open(source.c_str(), std::ios::in | std::ios::binary);
+    char magic[4];
+    replay_file_.read(magic, sizeof(magic));
+    return replay_file_ && memcmp(magic, kMagic, sizeof(magic)) == 0;
+  }
+
+  bool isOpened() const {
+    return replay_ ? replay_file_.is_open() : capture_.isOpened();
+  }
+
+  /* Replay at the recorded pace (default) or as fast as possible. */
+  void set_realtime(bool realtime) { realtime_ = realtime; }
+
+  /* Record every frame read from now on, as JPEG or as raw pixels. */
+  bool StartRecording(const std::string& filename, bool jpeg) {
+    record_file_.open(filename.c_str(), std::ios::out | std::ios::binary);
+    if (!record_file_)
+      return false;
+    record_file_.write(kMagic, sizeof(kMagic));
+    record_jpeg_ = jpeg;
+    return true;
+  }
+
+  /* Skip to the given frame number. */
+  bool Seek(int frame_index) {
+    if (!replay_)
+      return capture_.set(CV_CAP_PROP_POS_FRAMES, (double) frame_index);
+    replay_file_.clear();
+    replay_file_.seekg(sizeof(kMagic));
+    cv::Mat frame;
+    int64_t timestamp;
+    for (int i = 0; i < frame_index; ++i)
+      if (!ReadRecord(&frame, &timestamp))
+        return false;
+    started_ = false;
+    return true;
+  }
+
+  /* Read the next frame; frame is left empty at the end of the stream,
+   * as with cv::VideoCapture. */
+  FrameSource& operator>>(cv::Mat& frame) {
+    Read(&frame);
+    return *this;
+  }
+
+  /* Hold back until the next replayed frame is due. Read does the same
+   * by itself; calling this first keeps the pacing of a realtime replay
+   * out of the time measured around Read. */
+  void WaitForFrame() {
+    if (!replay_ || !realtime_ || !replay_file_)
+      return;
+    const std::streampos position = replay_file_.tellg();
+    int64_t timestamp;
+    replay_file_.read(reinterpret_cast<char*>(&timestamp), sizeof(timestamp));
+    const bool peeked = static_cast<bool>(replay_file_);
+    replay_file_.clear();
+    replay_file_.seekg(position);
+    if (peeked)
+      Pace(timestamp);
+  }
+
+  bool Read(cv::Mat* frame) {
+    int64_t timestamp;
+    if (replay_) {
+      if (!ReadRecord(frame, &timestamp)) {
+        frame->release();
+        return false;
+      }
+      Pace(timestamp);
+    } else {
+      capture_ >> *frame;
+      timestamp = Elapsed();
+    }
+    if (frame->empty())
+      return false;
+    if (record_file_.is_open())
+      WriteRecord(*frame, timestamp);
+    return true;
+  }
+
+ private:
+  /* Microseconds since the first frame on the monotonic clock. */
+  int64_t Elapsed() {
+    std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now();
+    if (!started_) {
+      start_ = now;
+      started_ = true;
+    }
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+      now - start_).count();
+  }
+
+  /* Hold a replayed frame back until its recorded time has come. */
+  void Pace(int64_t timestamp) {
+    if (!started_)
+      first_timestamp_ = timestamp;
+    const int64_t elapsed = Elapsed();
+    const int64_t due = timestamp - first_timestamp_;
+    if (realtime_ && due > elapsed)
+      std::this_thread::sleep_for(std::chrono::microseconds(due - elapsed));
+  }
+
+  bool ReadRecord(cv::Mat* frame, int64_t* timestamp) {
+    int32_t header[4];
+    uint32_t size;
+    replay_file_.read(reinterpret_cast<char*>(timestamp), sizeof(*timestamp));
+    replay_file_.read(reinterpret_cast<char*>(header), sizeof(header));
+    replay_file_.read(reinterpret_cast<char*>(&size), sizeof(size));
+    if (!replay_file_)
+      return false;
+    buffer_.resize(size);
+    replay_file_.read(reinterpret_cast<char*>(buffer_.data()), size);
+    if (!replay_file_)
+      return false;
+    if (header[3] == 1) {
+      *frame = cv::imdecode(buffer_, -1);
+    } else {
+      frame->create(header[0], header[1], header[2]);
+      if (frame->total() * frame->elemSize() != size)
+        return false;
+      memcpy(frame->data, buffer_.data(), size);
+    }
+    return !frame->empty();
+  }
+
+  void WriteRecord(const cv::Mat& frame, int64_t timestamp) {
+    cv::Mat pixels = frame.isContinuous() ? frame : frame.clone();
+    const uchar* data = pixels.data;
+    uint32_t size = pixels.total() * pixels.elemSize();
+    if (record_jpeg_) {
+      std::vector<int> params(2);
+      params[0] = CV_IMWRITE_JPEG_QUALITY;
+      params[1] = 95;
+      cv::imencode(".jpg", pixels, buffer_, params);
+      data = buffer_.data();
+      size = buffer_.size();
+    }
+    int32_t header[4] = {
+      pixels.rows, pixels.cols, pixels.type(), record_jpeg_ ? 1 : 0
+    };
+    record_file_.write(reinterpret_cast<const char*>(&timestamp),
+                       sizeof(timestamp));
+    record_file_.write(reinterpret_cast<const char*>(header), sizeof(header));
+    record_file_.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    record_file_.write(reinterpret_cast<const char*>(data), size);
+  }
+
+  static const char kMagic[4];
+
+  cv::VideoCapture capture_;
+  std::ifstream replay_file_;
+  std::ofstream record_file_;
+  std::vector<uchar> buffer_;
+  bool replay_;
+  bool realtime_;
+  bool record_jpeg_;
+  bool started_;
+  std::chrono::steady_clock::time_point start_;
+  int64_t first_timestamp_;
+};
+
+const char FrameSource::kMagic[4] = { 'F', 'R', 'M', '1' };
+
+#endif  // COMMON_FRAME_SOURCE_H_
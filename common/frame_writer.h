@@ -0,0 +1,124 @@
+#ifndef COMMON_FRAME_WRITER_H_
+#define COMMON_FRAME_WRITER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <caffe/caffe.hpp>
+
+/* Streams the per-frame results of the capture tools to a file or standard
+ * output, as JSON lines or as binary records. Each tool derives a writer
+ * that adds its own entries between BeginRecord and EndRecord.
+ *
+ * A binary stream is the magic "RES1" and a four-character tag naming the
+ * entry layout of the tool, followed by one record per frame: the frame
+ * index and the capture time in microseconds since the epoch (int64 each),
+ * the number of entries (uint32) and the entries. All numbers are
+ * little-endian whatever the host. A JSON line is an object with the
+ * fields "frame" and "timestamp_us" and those of the tool. */
+static const char kFrameWriterMagic[4] = { 'R', 'E', 'S', '1' };
+
+class FrameWriter {
+ public:
+  FrameWriter(const std::string& filename, const std::string& format,
+              const char tag[4])
+    : binary_(format == "bin"), buffer_(1 << 20) {
+    CHECK(format == "jsonl" || format == "bin")
+      << "Unknown result format " << format;
+    if (!filename.empty()) {
+      file_.rdbuf()->pubsetbuf(&buffer_[0], buffer_.size());
+      file_.open(filename.c_str(), std::ios::out | std::ios::binary);
+      CHECK(file_) << "Unable to open result file " << filename;
+    }
+    out_ = filename.empty() ? &std::cout : &file_;
+    *out_ << std::fixed << std::setprecision(4);
+    if (binary_) {
+      PutBytes(kFrameWriterMagic, sizeof(kFrameWriterMagic));
+      PutBytes(tag, 4);
+    }
+  }
+
+  void Flush() { out_->flush(); }
+
+ protected:
+  bool binary() const { return binary_; }
+
+  /* Stream the JSON fields of a record are written to. */
+  std::ostream& json() { return *out_; }
+
+  void BeginRecord(int64_t index, int64_t timestamp_us, uint32_t count) {
+    if (binary_) {
+      Put(index);
+      Put(timestamp_us);
+      Put(count);
+    } else {
+      *out_ << "{\"frame\":" << index
+            << ",\"timestamp_us\":" << timestamp_us;
+    }
+  }
+
+  /* Results on standard output are usually read by another process as
+   * they come, so do not hold them back in the stream buffer. */
+  void EndRecord() {
+    if (!binary_)
+      *out_ << "}\n";
+    if (out_ == &std::cout)
+      out_->flush();
+  }
+
+  /* Write an integer or float in little-endian byte order. */
+  template <typename T>
+  void Put(T value) {
+    static_assert(std::is_arithmetic<T>::value, "Put takes numbers only");
+    char bytes[sizeof(T)];
+    memcpy(bytes, &value, sizeof(T));
+    const uint16_t one = 1;
+    if (*reinterpret_cast<const uint8_t*>(&one) != 1)
+      std::reverse(bytes, bytes + sizeof(T));
+    out_->write(bytes, sizeof(T));
+  }
+
+  void PutBytes(const char* data, size_t size) { out_->write(data, size); }
+
+  /* JSON string literal of s. Control characters are escaped; bytes from
+   * 0x80 up pass through, so UTF-8 labels stay readable. */
+  static std::string JsonQuote(const std::string& s) {
+    std::string quoted = "\"";
+    for (size_t i = 0; i < s.size(); ++i) {
+      const unsigned char c = s[i];
+      if (c == '"' || c == '\\') {
+        quoted += '\\';
+        quoted += c;
+      } else if (c == '\n') {
+        quoted += "\\n";
+      } else if (c == '\r') {
+        quoted += "\\r";
+      } else if (c == '\t') {
+        quoted += "\\t";
+      } else if (c < 0x20) {
+        char escaped[8];
+        snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        quoted += escaped;
+      } else {
+        quoted += c;
+      }
+    }
+    return quoted + "\"";
+  }
+
+ private:
+  bool binary_;
+  std::vector<char> buffer_;
+  std::ofstream file_;
+  std::ostream* out_;
+};
+
+#endif  // COMMON_FRAME_WRITER_H_
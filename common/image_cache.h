@@ -0,0 +1,185 @@
+#ifndef COMMON_IMAGE_CACHE_H_
+#define COMMON_IMAGE_CACHE_H_
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "opencv2/opencv.hpp"
+
+/* Bounded LRU cache of decoded training images and the contents of their
+ * label files, keyed by index, that a pool of background threads fills
+ * ahead of navigation so that stepping to a neighbouring image does not
+ * wait for imread. Prefetch queues loads, CancelPrefetch drops the ones
+ * that have not started yet. Get returns a cached sample, waits for one
+ * that is being loaded or else loads it in the calling thread. Erase and
+ * Clear must be called when files are rewritten or indices shift. */
+class ImageCache {
+ public:
+  ImageCache(size_t capacity, int num_threads)
+    : capacity_(capacity), clock_(0), next_id_(0), stop_(false) {
+    for (int i = 0; i < num_threads; ++i)
+      threads_.push_back(std::thread(&ImageCache::Run, this));
+  }
+
+  ~ImageCache() { Close(); }
+
+  void Get(int index, const std::string& image_file,
+           const std::string& label_file, cv::Mat* image,
+           std::string* labels) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      std::map<int, Entry>::iterator it = entries_.find(index);
+      if (it != entries_.end() && it->second.ready) {
+        it->second.last_use = ++clock_;
+        *image = it->second.image;
+        *labels = it->second.labels;
+        return;
+      }
+      if (it != entries_.end()) {
+        ready_cond_.wait(lock);
+        continue;
+      }
+      lock.unlock();
+      Entry entry;
+      Load(image_file, label_file, &entry);
+      lock.lock();
+      Insert(index, next_id_++, entry);
+    }
+  }
+
+  void Prefetch(int index, const std::string& image_file,
+                const std::string& label_file) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (entries_.count(index))
+      return;
+    Job job = { index, image_file, label_file };
+    queue_.push_back(job);
+    queue_cond_.notify_one();
+  }
+
+  void CancelPrefetch() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.clear();
+  }
+
+  void Erase(int index) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.erase(index);
+  }
+
+  void Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+    queue_.clear();
+  }
+
+  void Close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+      queue_.clear();
+    }
+    queue_cond_.notify_all();
+    for (size_t i = 0; i < threads_.size(); ++i)
+      threads_[i].join();
+    threads_.clear();
+  }
+
+ private:
+  struct Entry {
+    Entry() : ready(false), id(0), last_use(0) {}
+    cv::Mat image;
+    std::string labels;
+    bool ready;
+    uint64_t id;
+    uint64_t last_use;
+  };
+
+  struct Job {
+    int index;
+    std::string image_file;
+    std::string label_file;
+  };
+
+  static void Load(const std::string& image_file, const std::string& label_file,
+                   Entry* entry) {
+    entry->image = cv::imread(image_file.c_str(), -1);
+    std::ifstream file(label_file.c_str());
+    entry->labels.assign(std::istreambuf_iterator<char>(file),
+                         std::istreambuf_iterator<char>());
+  }
+
+  void Run() {
+    for (;;) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      queue_cond_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+      if (stop_)
+        return;
+      Job job = queue_.front();
+      queue_.pop_front();
+      if (entries_.count(job.index))
+        continue;
+      /* Claim the index while loading, so that Get waits for this load
+       * instead of starting its own. An entry that was erased or replaced
+       * in the meantime has a different id and the result is dropped. */
+      const uint64_t id = next_id_++;
+      entries_[job.index].id = id;
+      lock.unlock();
+
+      Entry entry;
+      Load(job.image_file, job.label_file, &entry);
+
+      lock.lock();
+      std::map<int, Entry>::iterator it = entries_.find(job.index);
+      if (it != entries_.end() && it->second.id == id)
+        Insert(job.index, id, entry);
+      ready_cond_.notify_all();
+    }
+  }
+
+  void Insert(int index, uint64_t id, Entry entry) {
+    entry.ready = true;
+    entry.id = id;
+    entry.last_use = ++clock_;
+    entries_[index] = entry;
+    Evict();
+  }
+
+  /* Drop the least recently used loaded entries beyond capacity. Entries
+   * still loading are never dropped. */
+  void Evict() {
+    while (entries_.size() > capacity_) {
+      std::map<int, Entry>::iterator oldest = entries_.end();
+      for (std::map<int, Entry>::iterator it = entries_.begin();
+           it != entries_.end(); ++it)
+        if (it->second.ready &&
+            (oldest == entries_.end() ||
+             it->second.last_use < oldest->second.last_use))
+          oldest = it;
+      if (oldest == entries_.end())
+        return;
+      entries_.erase(oldest);
+    }
+  }
+
+  size_t capacity_;
+  uint64_t clock_;
+  uint64_t next_id_;
+  bool stop_;
+  std::map<int, Entry> entries_;
+  std::deque<Job> queue_;
+  std::mutex mutex_;
+  std::condition_variable queue_cond_;
+  std::condition_variable ready_cond_;
+  std::vector<std::thread> threads_;
+};
+
+#endif  // COMMON_IMAGE_CACHE_H_
@@ -0,0 +1,70 @@
+#ifndef COMMON_IMAGE_FILES_H_
+#define COMMON_IMAGE_FILES_H_
+
+#include <ctype.h>
+#include <dirent.h>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <caffe/caffe.hpp>
+
+static bool HasImageExtension(const std::string& name) {
+  static const char* extensions[] = {
+    ".jpg", ".jpeg", ".png", ".bmp", ".ppm", ".pgm", ".tif", ".tiff"
+  };
+  size_t dot = name.rfind('.');
+  if (dot == std::string::npos)
+    return false;
+  std::string ext = name.substr(dot);
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); ++i)
+    if (ext == extensions[i])
+      return true;
+  return false;
+}
+
+/* Collect the image files of a directory, sorted by name. */
+static std::vector<std::string> ListDirectory(const std::string& dir) {
+  std::vector<std::string> files;
+  DIR* dp = opendir(dir.c_str());
+  CHECK(dp) << "Unable to open directory " << dir;
+  struct dirent* dirp;
+  while ((dirp = readdir(dp)) != NULL) {
+    std::string name = dirp->d_name;
+    if (HasImageExtension(name))
+      files.push_back(dir + "/" + name);
+  }
+  closedir(dp);
+  std::sort(files.begin(), files.end());
+  return files;
+}
+
+/* Read a list file with one image path per line. */
+static std::vector<std::string> ReadFileList(const std::string& list_file) {
+  std::vector<std::string> files;
+  std::ifstream list(list_file.c_str());
+  CHECK(list) << "Unable to open list file " << list_file;
+  std::string line;
+  while (std::getline(list, line))
+    if (!line.empty())
+      files.push_back(line);
+  return files;
+}
+
+/* Up to max_images image files of dir, spread evenly over its sorted
+ * listing so that runs of near-identical frames don't dominate. */
+static std::vector<std::string> CalibrationFiles(const std::string& dir,
+                                                 int max_images) {
+  std::vector<std::string> files = ListDirectory(dir);
+  CHECK(!files.empty()) << "No calibration images in " << dir;
+  if (max_images <= 0 || (int) files.size() <= max_images)
+    return files;
+  std::vector<std::string> subset;
+  for (int i = 0; i < max_images; ++i)
+    subset.push_back(files[(size_t) i * files.size() / max_images]);
+  return subset;
+}
+
+#endif  // COMMON_IMAGE_FILES_H_
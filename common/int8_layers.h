@@ -0,0 +1,407 @@
+#ifndef COMMON_INT8_LAYERS_H_
+#define COMMON_INT8_LAYERS_H_
+
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <caffe/caffe.hpp>
+#include <caffe/layers/conv_layer.hpp>
+#include <caffe/layers/inner_product_layer.hpp>
+
+/* Rows of the int8 operands are padded with zeros to a multiple of this
+ * many values, so the inner loop of DotTileInt16 vectorizes without a
+ * scalar tail. */
+static const int kInt8RowAlign = 8;
+
+static int Int8RowStride(int row_size) {
+  return (row_size + kInt8RowAlign - 1) / kInt8RowAlign * kInt8RowAlign;
+}
+
+/* Convolution and inner product weights quantized to int8, symmetric with
+ * one scale per output channel: weight = data * scale. GemmInt16 widens
+ * them to int16, the operand width of the SIMD multiply-adds, one tile of
+ * rows at a time. */
+struct QuantizedWeights {
+  std::vector<int8_t> data;  // one row of stride values per output
+  std::vector<float> scale;
+  int row_size;
+  int stride;
+};
+
+template <typename Dtype>
+static caffe::shared_ptr<QuantizedWeights> QuantizeWeights(
+    const caffe::Blob<Dtype>& blob) {
+  caffe::shared_ptr<QuantizedWeights> weights(new QuantizedWeights);
+  const int num_output = blob.shape(0);
+  weights->row_size = blob.count() / num_output;
+  weights->stride = Int8RowStride(weights->row_size);
+  weights->data.assign(num_output * weights->stride, 0);
+  weights->scale.resize(num_output);
+  for (int o = 0; o < num_output; ++o) {
+    const Dtype* row = blob.cpu_data() + o * weights->row_size;
+    float range = 0;
+    for (int k = 0; k < weights->row_size; ++k)
+      range = std::max(range, (float) std::fabs(row[k]));
+    const float scale = range > 0 ? range / 127 : 1.f;
+    weights->scale[o] = scale;
+    for (int k = 0; k < weights->row_size; ++k)
+      weights->data[o * weights->stride + k] =
+        (int8_t) std::lrint(row[k] / scale);
+  }
+  return weights;
+}
+
+/* Quantize n activations with the given scale, saturating at +-127. */
+template <typename Dtype>
+static void QuantizeActivations(const Dtype* x, int n, float scale,
+                                int16_t* q) {
+  const float inv_scale = 1 / scale;
+  for (int i = 0; i < n; ++i) {
+    float v = x[i] * inv_scale;
+    v = std::min(std::max(v, -127.f), 127.f);
+    q[i] = (int16_t) (v >= 0 ? v + 0.5f : v - 0.5f);
+  }
+}
+
+/* The R x C dot products of R rows of w with C rows of c, all of k
+ * values, into out with a row stride of ldo. Each value loaded is used R
+ * or C times from registers, and the inner loop is a plain loop the
+ * compiler turns into 16-bit SIMD multiply-adds into 32-bit sums. */
+template <int R, int C>
+static inline void DotTileInt16(const int16_t* w, const int16_t* c, int k,
+                                int32_t* out, int ldo) {
+  int32_t sum[R][C] = {{0}};
+  for (int i = 0; i < k; ++i)
+    for (int r = 0; r < R; ++r)
+      for (int j = 0; j < C; ++j)
+        sum[r][j] += w[r * k + i] * c[j * k + i];
+  for (int r = 0; r < R; ++r)
+    for (int j = 0; j < C; ++j)
+      out[r * ldo + j] = sum[r][j];
+}
+
+/* out[o * n + p] = dot(w row o, c row p) for m rows of w and n rows of c,
+ * each of k values, in 4 x 4 tiles. Each 4-row tile of w is sign-extended
+ * to int16 once and then used for all of c. */
+static void GemmInt16(const int8_t* w, const int16_t* c, int m, int n,
+                      int k, int32_t* out) {
+  std::vector<int16_t> tile(4 * k);
+  int o = 0;
+  for (; o + 4 <= m; o += 4) {
+    std::copy(w + o * k, w + (o + 4) * k, tile.begin());
+    int p = 0;
+    for (; p + 4 <= n; p += 4)
+      DotTileInt16<4, 4>(&tile[0], c + p * k, k, out + o * n + p, n);
+    for (; p < n; ++p)
+      DotTileInt16<4, 1>(&tile[0], c + p * k, k, out + o * n + p, n);
+  }
+  for (; o < m; ++o) {
+    std::copy(w + o * k, w + (o + 1) * k, tile.begin());
+    for (int p = 0; p < n; ++p)
+      DotTileInt16<1, 1>(&tile[0], c + p * k, k, out + o * n + p, n);
+  }
+}
+
+/* Convolution running on int8 weights and inputs in CPU mode. The float
+ * weights in blobs_ are used until Quantize is called, and in GPU mode;
+ * in CPU mode QuantizeNet releases them afterwards. Only 2D convolutions
+ * are quantized. */
+template <typename Dtype>
+class Int8ConvolutionLayer : public caffe::ConvolutionLayer<Dtype> {
+ public:
+  explicit Int8ConvolutionLayer(const caffe::LayerParameter& param)
+    : caffe::ConvolutionLayer<Dtype>(param), input_scale_(1.f) {}
+
+  virtual inline const char* type() const { return "Int8Convolution"; }
+
+  /* Quantize the weights for inputs within [-input_range, input_range]. */
+  void Quantize(float input_range) {
+    if (this->blobs_[0]->num_axes() != 4)
+      return;
+    weights_ = QuantizeWeights(*this->blobs_[0]);
+    input_scale_ = input_range > 0 ? input_range / 127 : 1.f;
+  }
+
+  void ShareQuantization(const Int8ConvolutionLayer& other) {
+    weights_ = other.weights_;
+    input_scale_ = other.input_scale_;
+  }
+
+  /* Bytes of the int8 weights and their scales; 0 if not quantized. */
+  size_t quantized_bytes() const {
+    return weights_ ? weights_->data.size() * sizeof(int8_t) +
+                      weights_->scale.size() * sizeof(float) : 0;
+  }
+
+ protected:
+  virtual void Forward_cpu(const std::vector<caffe::Blob<Dtype>*>& bottom,
+                           const std::vector<caffe::Blob<Dtype>*>& top) {
+    if (!weights_) {
+      caffe::ConvolutionLayer<Dtype>::Forward_cpu(bottom, top);
+      return;
+    }
+    const caffe::ConvolutionParameter& param =
+      this->layer_param_.convolution_param();
+    const int stride_h = param.has_stride_h() ? param.stride_h() :
+                         param.stride_size() ? param.stride(0) : 1;
+    const int stride_w = param.has_stride_h() ? param.stride_w() :
+                         param.stride_size() ? param.stride(
+                           param.stride_size() - 1) : 1;
+    const int pad_h = param.has_pad_h() ? param.pad_h() :
+                      param.pad_size() ? param.pad(0) : 0;
+    const int pad_w = param.has_pad_h() ? param.pad_w() :
+                      param.pad_size() ? param.pad(param.pad_size() - 1) : 0;
+    const int dilation_h = param.dilation_size() ? param.dilation(0) : 1;
+    const int dilation_w = param.dilation_size() ?
+                           param.dilation(param.dilation_size() - 1) : 1;
+
+    const caffe::Blob<Dtype>& w = *this->blobs_[0];
+    const int num_output = w.shape(0);
+    const int kernel_h = w.shape(2);
+    const int kernel_w = w.shape(3);
+    const int channels = bottom[0]->shape(1);
+    const int height = bottom[0]->shape(2);
+    const int width = bottom[0]->shape(3);
+    const int group_channels = w.shape(1);
+    const int group = channels / group_channels;
+    const int group_outputs = num_output / group;
+    const int out_h = top[0]->shape(2);
+    const int out_w = top[0]->shape(3);
+    const int spatial = out_h * out_w;
+    const int stride = weights_->stride;
+    const Dtype* bias = param.bias_term() ? this->blobs_[1]->cpu_data() : NULL;
+
+    input_.resize(channels * height * width);
+    columns_.assign(spatial * stride, 0);
+    sums_.resize(group_outputs * spatial);
+    for (size_t i = 0; i < bottom.size(); ++i) {
+      for (int n = 0; n < bottom[i]->shape(0); ++n) {
+        QuantizeActivations(bottom[i]->cpu_data() + bottom[i]->offset(n),
+                            input_.size(), input_scale_, &input_[0]);
+        Dtype* output = top[i]->mutable_cpu_data() + top[i]->offset(n);
+        for (int g = 0; g < group; ++g) {
+          /* Transposed im2col: the k inputs of each output position are
+           * contiguous and padded like the weight rows. */
+          for (int y = 0; y < out_h; ++y) {
+            for (int x = 0; x < out_w; ++x) {
+              int16_t* col = &columns_[(y * out_w + x) * stride];
+              for (int c = 0; c < group_channels; ++c) {
+                const int16_t* plane =
+                  &input_[(g * group_channels + c) * height * width];
+                for (int ky = 0; ky < kernel_h; ++ky) {
+                  const int iy = y * stride_h - pad_h + ky * dilation_h;
+                  for (int kx = 0; kx < kernel_w; ++kx) {
+                    const int ix = x * stride_w - pad_w + kx * dilation_w;
+                    *col++ = (iy >= 0 && iy < height && ix >= 0 && ix < width)
+                             ? plane[iy * width + ix] : 0;
+                  }
+                }
+              }
+            }
+          }
+
+          GemmInt16(&weights_->data[g * group_outputs * stride],
+                    &columns_[0], group_outputs, spatial, stride, &sums_[0]);
+          for (int j = 0; j < group_outputs; ++j) {
+            const int o = g * group_outputs + j;
+            const float scale = weights_->scale[o] * input_scale_;
+            const Dtype b = bias ? bias[o] : 0;
+            const int32_t* sum = &sums_[j * spatial];
+            Dtype* out = output + o * spatial;
+            for (int p = 0; p < spatial; ++p)
+              out[p] = sum[p] * scale + b;
+          }
+        }
+      }
+    }
+  }
+
+ private:
+  caffe::shared_ptr<QuantizedWeights> weights_;
+  float input_scale_;
+  std::vector<int16_t> input_;
+  std::vector<int16_t> columns_;
+  std::vector<int32_t> sums_;
+};
+
+/* Inner product running on int8 weights and inputs in CPU mode, see
+ * Int8ConvolutionLayer. Transposed weights are not quantized. */
+template <typename Dtype>
+class Int8InnerProductLayer : public caffe::InnerProductLayer<Dtype> {
+ public:
+  explicit Int8InnerProductLayer(const caffe::LayerParameter& param)
+    : caffe::InnerProductLayer<Dtype>(param), input_scale_(1.f) {}
+
+  virtual inline const char* type() const { return "Int8InnerProduct"; }
+
+  void Quantize(float input_range) {
+    if (this->layer_param_.inner_product_param().transpose())
+      return;
+    weights_ = QuantizeWeights(*this->blobs_[0]);
+    input_scale_ = input_range > 0 ? input_range / 127 : 1.f;
+  }
+
+  void ShareQuantization(const Int8InnerProductLayer& other) {
+    weights_ = other.weights_;
+    input_scale_ = other.input_scale_;
+  }
+
+  size_t quantized_bytes() const {
+    return weights_ ? weights_->data.size() * sizeof(int8_t) +
+                      weights_->scale.size() * sizeof(float) : 0;
+  }
+
+ protected:
+  virtual void Forward_cpu(const std::vector<caffe::Blob<Dtype>*>& bottom,
+                           const std::vector<caffe::Blob<Dtype>*>& top) {
+    if (!weights_) {
+      caffe::InnerProductLayer<Dtype>::Forward_cpu(bottom, top);
+      return;
+    }
+    const int num_output = this->blobs_[0]->shape(0);
+    const int k = weights_->row_size;
+    const int stride = weights_->stride;
+    const int m = bottom[0]->count() / k;
+    const Dtype* bias =
+      this->layer_param_.inner_product_param().bias_term() ?
+      this->blobs_[1]->cpu_data() : NULL;
+
+    input_.assign(m * stride, 0);
+    for (int r = 0; r < m; ++r)
+      QuantizeActivations(bottom[0]->cpu_data() + r * k, k, input_scale_,
+                          &input_[r * stride]);
+    sums_.resize(num_output * m);
+    GemmInt16(&weights_->data[0], &input_[0], num_output, m, stride,
+              &sums_[0]);
+    Dtype* output = top[0]->mutable_cpu_data();
+    for (int r = 0; r < m; ++r) {
+      for (int o = 0; o < num_output; ++o) {
+        output[r * num_output + o] =
+          sums_[o * m + r] * weights_->scale[o] * input_scale_ +
+          (bias ? bias[o] : 0);
+      }
+    }
+  }
+
+ private:
+  caffe::shared_ptr<QuantizedWeights> weights_;
+  float input_scale_;
+  std::vector<int16_t> input_;
+  std::vector<int32_t> sums_;
+};
+
+/* The registry macros name the layer classes from within namespace
+ * caffe. */
+namespace caffe {
+REGISTER_LAYER_CLASS(Int8Convolution);
+REGISTER_LAYER_CLASS(Int8InnerProduct);
+}  // namespace caffe
+
+/* Switch the convolution and inner product layers of param to their int8
+ * versions. The layer names and blobs are unchanged, so the int8 net can
+ * share the trained weights of the float net. */
+static void UseInt8Layers(caffe::NetParameter* param) {
+  for (int i = 0; i < param->layer_size(); ++i) {
+    caffe::LayerParameter* layer = param->mutable_layer(i);
+    if (layer->type() == "Convolution")
+      layer->set_type("Int8Convolution");
+    else if (layer->type() == "InnerProduct")
+      layer->set_type("Int8InnerProduct");
+  }
+}
+
+/* Run a forward pass of net and widen ranges, indexed by layer, to the
+ * largest absolute input value of its convolution and inner product
+ * layers. The net runs one layer at a time and each input is read right
+ * after its layer, while the memory plan still keeps it. */
+static void RecordInputRanges(caffe::Net<float>* net,
+                              std::vector<float>* ranges) {
+  ranges->resize(net->layers().size(), 0.f);
+  for (size_t i = 0; i < net->layers().size(); ++i) {
+    net->ForwardFromTo(i, i);
+    const std::string type = net->layers()[i]->type();
+    if (type != "Convolution" && type != "InnerProduct")
+      continue;
+    const caffe::Blob<float>* input = net->bottom_vecs()[i][0];
+    const float* data = input->cpu_data();
+    float range = (*ranges)[i];
+    for (int j = 0; j < input->count(); ++j)
+      range = std::max(range, std::fabs(data[j]));
+    (*ranges)[i] = range;
+  }
+}
+
+/* Drop the data of blob but keep its shape: it shares a fresh buffer,
+ * which is only allocated if read. The old buffer is freed once no other
+ * blob shares it. */
+template <typename Dtype>
+static void ReleaseBlobData(caffe::Blob<Dtype>* blob) {
+  caffe::Blob<Dtype> empty(blob->shape());
+  blob->ShareData(empty);
+}
+
+/* In CPU mode, release the float weights of the layers of net that are
+ * quantized in int8_net, a net of the same layers. Call it on the net the
+ * int8 nets share their trained layers with, once none of them reads it
+ * any more; QuantizeNet releases those of the int8 nets themselves. */
+static void ReleaseQuantizedWeights(caffe::Net<float>* net,
+                                    const caffe::Net<float>& int8_net) {
+  if (caffe::Caffe::mode() != caffe::Caffe::CPU)
+    return;
+  for (size_t i = 0; i < net->layers().size(); ++i) {
+    const caffe::Layer<float>* layer = int8_net.layers()[i].get();
+    const Int8ConvolutionLayer<float>* conv =
+      dynamic_cast<const Int8ConvolutionLayer<float>*>(layer);
+    const Int8InnerProductLayer<float>* ip =
+      dynamic_cast<const Int8InnerProductLayer<float>*>(layer);
+    if ((conv && conv->quantized_bytes()) || (ip && ip->quantized_bytes()))
+      ReleaseBlobData(net->layers()[i]->blobs()[0].get());
+  }
+}
+
+/* Quantize the int8 layers of net for the calibrated input ranges, or
+ * share the quantized weights of the same layers of reference, if given.
+ * In CPU mode the float weights of the quantized layers are released.
+ * Return the bytes of the int8 weights, scales included, and of the float
+ * weights they replace. */
+static std::pair<size_t, size_t> QuantizeNet(caffe::Net<float>* net,
+                                             const std::vector<float>& ranges,
+                                             caffe::Net<float>* reference) {
+  std::pair<size_t, size_t> bytes(0, 0);
+  for (size_t i = 0; i < net->layers().size(); ++i) {
+    caffe::Layer<float>* layer = net->layers()[i].get();
+    caffe::Layer<float>* other =
+      reference ? reference->layers()[i].get() : NULL;
+    size_t quantized = 0;
+    if (Int8ConvolutionLayer<float>* conv =
+          dynamic_cast<Int8ConvolutionLayer<float>*>(layer)) {
+      if (other)
+        conv->ShareQuantization(
+          *dynamic_cast<Int8ConvolutionLayer<float>*>(other));
+      else
+        conv->Quantize(ranges[i]);
+      quantized = conv->quantized_bytes();
+    } else if (Int8InnerProductLayer<float>* ip =
+                 dynamic_cast<Int8InnerProductLayer<float>*>(layer)) {
+      if (other)
+        ip->ShareQuantization(
+          *dynamic_cast<Int8InnerProductLayer<float>*>(other));
+      else
+        ip->Quantize(ranges[i]);
+      quantized = ip->quantized_bytes();
+    }
+    if (quantized) {
+      bytes.first += quantized;
+      bytes.second += layer->blobs()[0]->count() * sizeof(float);
+      if (caffe::Caffe::mode() == caffe::Caffe::CPU)
+        ReleaseBlobData(layer->blobs()[0].get());
+    }
+  }
+  return bytes;
+}
+
+#endif  // COMMON_INT8_LAYERS_H_
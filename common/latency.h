@@ -0,0 +1,137 @@
+#ifndef COMMON_LATENCY_H_
+#define COMMON_LATENCY_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+
+/* Pipeline stages timed by the latency probes. */
+enum Stage {
+  kDecode,
+  kPreprocess,
+  kForward,
+  kPostprocess,
+  kRender,
+  kNumStages
+};
+
+static const char* kStageNames[kNumStages] = {
+  "decode", "preprocess", "forward", "postprocess", "render"
+};
+
+/* Latency histogram in microseconds with logarithmic buckets, four per
+ * power of two, so percentiles are accurate to within 25%. Recording is a
+ * pair of relaxed atomic increments and can be done from any thread while
+ * other threads read percentiles. */
+class LatencyHistogram {
+ public:
+  LatencyHistogram() : count_(0) {
+    for (int i = 0; i < kNumBuckets; ++i)
+      buckets_[i].store(0, std::memory_order_relaxed);
+  }
+
+  void Record(int64_t micros) {
+    buckets_[Bucket(micros)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  int64_t count() const { return count_.load(std::memory_order_relaxed); }
+
+  /* Upper bound of the bucket holding the p-th percentile, p in [0, 1]. */
+  int64_t Percentile(double p) const {
+    const int64_t total = count();
+    if (total == 0)
+      return 0;
+    const int64_t rank = std::max<int64_t>(1, std::ceil(p * total));
+    int64_t seen = 0;
+    for (int i = 0; i < kNumBuckets; ++i) {
+      seen += buckets_[i].load(std::memory_order_relaxed);
+      if (seen >= rank)
+        return UpperBound(i);
+    }
+    return UpperBound(kNumBuckets - 1);
+  }
+
+ private:
+  static const int kNumBuckets = 160;
+
+  /* Values below 4 get a bucket each; above that, the two bits after the
+   * leading one select one of four buckets per power of two. */
+  static int Bucket(int64_t micros) {
+    if (micros < 4)
+      return std::max<int64_t>(micros, 0);
+    const int msb = 63 - __builtin_clzll(micros);
+    const int sub = (micros >> (msb - 2)) & 3;
+    return std::min(4 + (msb - 2) * 4 + sub, kNumBuckets - 1);
+  }
+
+  static int64_t UpperBound(int bucket) {
+    if (bucket < 4)
+      return bucket;
+    const int shift = (bucket - 4) / 4;
+    const int sub = (bucket - 4) % 4;
+    return ((int64_t) (5 + sub) << shift) - 1;
+  }
+
+  std::atomic<int64_t> buckets_[kNumBuckets];
+  std::atomic<int64_t> count_;
+};
+
+/* Per-stage latency histograms of an engine and the tool driving it. */
+class LatencyStats {
+ public:
+  void Record(Stage stage, int64_t micros) {
+    histograms_[stage].Record(micros);
+  }
+
+  const LatencyHistogram& histogram(Stage stage) const {
+    return histograms_[stage];
+  }
+
+  /* Print p50, p95 and p99 in microseconds of every stage with samples. */
+  void Dump(std::ostream* out) const {
+    *out << std::left << std::setw(12) << "stage" << std::right
+         << std::setw(10) << "count" << std::setw(10) << "p50(us)"
+         << std::setw(10) << "p95(us)" << std::setw(10) << "p99(us)"
+         << std::endl;
+    for (int s = 0; s < kNumStages; ++s) {
+      const LatencyHistogram& h = histograms_[s];
+      if (h.count() == 0)
+        continue;
+      *out << std::left << std::setw(12) << kStageNames[s] << std::right
+           << std::setw(10) << h.count()
+           << std::setw(10) << h.Percentile(0.50)
+           << std::setw(10) << h.Percentile(0.95)
+           << std::setw(10) << h.Percentile(0.99) << std::endl;
+    }
+  }
+
+ private:
+  LatencyHistogram histograms_[kNumStages];
+};
+
+/* Records the time from construction to destruction on the monotonic
+ * clock into one stage of a LatencyStats. */
+class ScopedLatency {
+ public:
+  ScopedLatency(LatencyStats* stats, Stage stage)
+    : stats_(stats), stage_(stage),
+      start_(std::chrono::steady_clock::now()) {}
+
+  ~ScopedLatency() {
+    stats_->Record(stage_,
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start_).count());
+  }
+
+ private:
+  LatencyStats* stats_;
+  Stage stage_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+#endif  // COMMON_LATENCY_H_
@@ -0,0 +1,178 @@
+#ifndef COMMON_LMDB_WRITER_H_
+#define COMMON_LMDB_WRITER_H_
+
+#include <string>
+#include <vector>
+
+#ifdef WITH_LMDB
+#include <stdlib.h>
+#include <memory>
+#include <mutex>
+#include <sstream>
+
+#include "boost/filesystem.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/db.hpp"
+#endif
+
+/* Floats per object row of the label Datums written by LmdbWriter. */
+static const int kLmdbLabelWidth = 16;
+
+#ifdef WITH_LMDB
+
+/* Writes labeled samples straight into a pair of Caffe LMDBs under dir,
+ * keyed by sample name, so that annotation output feeds Caffe training
+ * without a conversion pass. Puts are committed in batches of batch_size
+ * and on Close; putting a name again replaces its sample.
+ *
+ * images/ holds the encoded image of each sample as a Datum labeled with
+ * the class of its first object (-1 if it has none).
+ *
+ * labels/ holds one float Datum per sample, padded to a fixed shape the
+ * way DIGITS stores DetectNet labels, so that every sample batches
+ * alike: 1 channel x max_objects rows x kLmdbLabelWidth (16) columns.
+ * Row i is the i-th text label line: column 0 the class index (-1 if
+ * unknown), then the numbers of the line in order, which for a KITTI
+ * line are truncated, occluded, alpha, left, top, right, bottom, the 3-D
+ * dimensions and location, rotation_y and score. Missing columns and the
+ * rows past the last object are zero, so padding rows are empty boxes.
+ * Numbers past the 15th and lines past max_objects are dropped. */
+class LmdbWriter {
+ public:
+  LmdbWriter(const std::string& dir, const std::vector<std::string>& classes,
+             int batch_size, int max_objects)
+    : dir_(dir), classes_(classes), batch_size_(batch_size),
+      max_objects_(max_objects), pending_(0) {}
+
+  ~LmdbWriter() { Close(); }
+
+  bool Open() {
+    boost::system::error_code error;
+    boost::filesystem::create_directories(dir_, error);
+    images_ = OpenDB(dir_ + "/images");
+    labels_ = OpenDB(dir_ + "/labels");
+    images_txn_.reset(images_->NewTransaction());
+    labels_txn_.reset(labels_->NewTransaction());
+    return true;
+  }
+
+  void Put(const std::string& name, const std::vector<unsigned char>& image,
+           int rows, int cols, int channels, const std::string& labels) {
+    std::vector<float> objects(max_objects_ * kLmdbLabelWidth, 0.f);
+    int num_objects = 0;
+    int first_class = -1;
+    std::istringstream lines(labels);
+    std::string line;
+    while (num_objects < max_objects_ && std::getline(lines, line)) {
+      std::istringstream fields(line);
+      std::string type;
+      if (!(fields >> type))
+        continue;
+      float* row = &objects[num_objects * kLmdbLabelWidth];
+      row[0] = ClassIndex(type);
+      float value;
+      for (int j = 1; j < kLmdbLabelWidth && fields >> value; ++j)
+        row[j] = value;
+      if (num_objects++ == 0)
+        first_class = (int) row[0];
+    }
+
+    caffe::Datum image_datum;
+    image_datum.set_channels(channels);
+    image_datum.set_height(rows);
+    image_datum.set_width(cols);
+    image_datum.set_data(image.data(), image.size());
+    image_datum.set_encoded(true);
+    image_datum.set_label(first_class);
+
+    caffe::Datum label_datum;
+    label_datum.set_channels(1);
+    label_datum.set_height(max_objects_);
+    label_datum.set_width(kLmdbLabelWidth);
+    for (size_t i = 0; i < objects.size(); ++i)
+      label_datum.add_float_data(objects[i]);
+
+    std::string image_value, label_value;
+    image_datum.SerializeToString(&image_value);
+    label_datum.SerializeToString(&label_value);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    images_txn_->Put(name, image_value);
+    labels_txn_->Put(name, label_value);
+    if (++pending_ >= batch_size_)
+      Commit();
+  }
+
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!images_)
+      return;
+    if (pending_ > 0)
+      Commit();
+    images_txn_.reset();
+    labels_txn_.reset();
+    images_->Close();
+    labels_->Close();
+    images_.reset();
+    labels_.reset();
+  }
+
+ private:
+  static std::unique_ptr<caffe::db::DB> OpenDB(const std::string& path) {
+    std::unique_ptr<caffe::db::DB> db(caffe::db::GetDB("lmdb"));
+    db->Open(path, boost::filesystem::exists(path) ? caffe::db::WRITE
+                                                   : caffe::db::NEW);
+    return db;
+  }
+
+  /* Index of a class name in the classes file, or the class number
+   * itself for labels that store one. */
+  int ClassIndex(const std::string& type) const {
+    for (size_t i = 0; i < classes_.size(); ++i)
+      if (classes_[i] == type)
+        return i;
+    char* end;
+    const long index = strtol(type.c_str(), &end, 10);
+    return *end == '\0' ? (int) index : -1;
+  }
+
+  void Commit() {
+    images_txn_->Commit();
+    labels_txn_->Commit();
+    images_txn_.reset(images_->NewTransaction());
+    labels_txn_.reset(labels_->NewTransaction());
+    pending_ = 0;
+  }
+
+  std::string dir_;
+  std::vector<std::string> classes_;
+  int batch_size_;
+  int max_objects_;
+  int pending_;
+  std::mutex mutex_;
+  std::unique_ptr<caffe::db::DB> images_;
+  std::unique_ptr<caffe::db::DB> labels_;
+  std::unique_ptr<caffe::db::Transaction> images_txn_;
+  std::unique_ptr<caffe::db::Transaction> labels_txn_;
+};
+
+#else
+
+/* Built without WITH_LMDB, so that the annotation tools don't link
+ * against Caffe: Open fails and nothing is written. */
+class LmdbWriter {
+ public:
+  LmdbWriter(const std::string& dir, const std::vector<std::string>& classes,
+             int batch_size, int max_objects) {}
+
+  bool Open() { return false; }
+
+  void Put(const std::string& name, const std::vector<unsigned char>& image,
+           int rows, int cols, int channels, const std::string& labels) {}
+
+  void Close() {}
+};
+
+#endif  // WITH_LMDB
+
+#endif  // COMMON_LMDB_WRITER_H_
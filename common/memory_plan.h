@@ -0,0 +1,248 @@
+#ifndef COMMON_MEMORY_PLAN_H_
+#define COMMON_MEMORY_PLAN_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <caffe/caffe.hpp>
+
+/* Alignment in bytes of the arena and of every buffer planned in it, for
+ * the vectorized layers. */
+static const size_t kPlanAlignment = 64;
+
+/* Allocator of the arena: std::allocator only guarantees malloc
+ * alignment, which would leave the aligned offsets unaligned. */
+template <typename T>
+struct PlanAllocator {
+  typedef T value_type;
+
+  PlanAllocator() {}
+  template <typename U>
+  PlanAllocator(const PlanAllocator<U>&) {}
+
+  T* allocate(size_t n) {
+    void* p = NULL;
+    if (posix_memalign(&p, kPlanAlignment, std::max<size_t>(n, 1) * sizeof(T)))
+      throw std::bad_alloc();
+    return static_cast<T*>(p);
+  }
+
+  void deallocate(T* p, size_t) { free(p); }
+};
+
+template <typename T, typename U>
+bool operator==(const PlanAllocator<T>&, const PlanAllocator<U>&) {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const PlanAllocator<T>&, const PlanAllocator<U>&) {
+  return false;
+}
+
+typedef std::vector<float, PlanAllocator<float> > PlanArena;
+
+/* An intermediate buffer of the memory plan: a set of aliasing blobs,
+ * live from the first layer using any of them to the last. */
+struct PlannedBuffer {
+  std::vector<caffe::Blob<float>*> blobs;
+  size_t count;
+  int first;
+  int last;
+  size_t offset;
+  bool pinned;
+};
+
+static bool CompareBufferSize(const PlannedBuffer& a, const PlannedBuffer& b) {
+  return a.count > b.count;
+}
+
+/* Layers whose tops alias their first bottom. Split and Flatten only
+ * share the data in Forward_cpu, so their tops still have memory of
+ * their own when the plan is made. */
+static bool AliasesBottom(const std::string& type) {
+  return type == "Split" || type == "Flatten" || type == "Reshape";
+}
+
+typedef std::map<caffe::Blob<float>*, caffe::Blob<float>*> AliasSets;
+
+/* Representative of the alias set of blob, added as a set of its own if
+ * it is new. */
+static caffe::Blob<float>* AliasRoot(AliasSets* sets,
+                                     caffe::Blob<float>* blob) {
+  if (!sets->count(blob))
+    (*sets)[blob] = blob;
+  while ((*sets)[blob] != blob) {
+    (*sets)[blob] = (*sets)[(*sets)[blob]];
+    blob = (*sets)[blob];
+  }
+  return blob;
+}
+
+static void JoinAliases(AliasSets* sets, caffe::Blob<float>* a,
+                        caffe::Blob<float>* b) {
+  caffe::Blob<float>* root_a = AliasRoot(sets, a);
+  caffe::Blob<float>* root_b = AliasRoot(sets, b);
+  if (root_a != root_b)
+    (*sets)[root_a] = root_b;
+}
+
+/* Point the intermediate blobs of net into arena so that blobs whose
+ * lifetimes don't overlap share memory. Blobs that alias each other, by
+ * sharing a SyncedMemory (in-place layers, Reshape) or through the tops
+ * of Split and Flatten, are planned as a single buffer, live until the
+ * last reader of any of them. Alias sets holding an input or output blob
+ * keep their own memory. Buffers are placed largest first at the lowest
+ * offset free over their lifetime. Only the forward pass is planned, and
+ * only in CPU mode: a GPU forward keeps its device buffers. Run again
+ * after every reshape. Return the planned bytes and the bytes of one
+ * buffer per blob. */
+static std::pair<size_t, size_t> PlanMemory(caffe::Net<float>* net,
+                                            PlanArena* arena) {
+  AliasSets sets;
+  std::map<caffe::SyncedMemory*, caffe::Blob<float>*> owners;
+  for (size_t i = 0; i < net->layers().size(); ++i) {
+    const std::vector<caffe::Blob<float>*>& bottom = net->bottom_vecs()[i];
+    const std::vector<caffe::Blob<float>*>& top = net->top_vecs()[i];
+    for (int side = 0; side < 2; ++side) {
+      const std::vector<caffe::Blob<float>*>& blobs = side ? top : bottom;
+      for (size_t j = 0; j < blobs.size(); ++j) {
+        caffe::SyncedMemory* memory = blobs[j]->data().get();
+        if (owners.count(memory))
+          JoinAliases(&sets, blobs[j], owners[memory]);
+        else
+          owners[memory] = blobs[j];
+        AliasRoot(&sets, blobs[j]);
+      }
+    }
+    if (!bottom.empty() && AliasesBottom(net->layers()[i]->type())) {
+      for (size_t j = 0; j < top.size(); ++j)
+        JoinAliases(&sets, top[j], bottom[0]);
+    }
+  }
+
+  std::map<caffe::Blob<float>*, PlannedBuffer> buffers;
+  for (size_t i = 0; i < net->layers().size(); ++i) {
+    for (int side = 0; side < 2; ++side) {
+      const std::vector<caffe::Blob<float>*>& blobs =
+        side ? net->top_vecs()[i] : net->bottom_vecs()[i];
+      for (size_t j = 0; j < blobs.size(); ++j) {
+        caffe::Blob<float>* root = AliasRoot(&sets, blobs[j]);
+        if (!buffers.count(root)) {
+          PlannedBuffer buffer;
+          buffer.count = 0;
+          buffer.first = i;
+          buffer.offset = 0;
+          buffer.pinned = false;
+          buffers[root] = buffer;
+        }
+        PlannedBuffer& buffer = buffers[root];
+        buffer.count = std::max<size_t>(buffer.count, blobs[j]->count());
+        buffer.last = i;
+      }
+    }
+  }
+  size_t naive = 0;
+  for (AliasSets::iterator it = sets.begin(); it != sets.end(); ++it) {
+    buffers[AliasRoot(&sets, it->first)].blobs.push_back(it->first);
+    naive += it->first->count();
+  }
+  for (size_t i = 0; i < net->input_blobs().size(); ++i)
+    if (sets.count(net->input_blobs()[i]))
+      buffers[AliasRoot(&sets, net->input_blobs()[i])].pinned = true;
+  for (size_t i = 0; i < net->output_blobs().size(); ++i)
+    if (sets.count(net->output_blobs()[i]))
+      buffers[AliasRoot(&sets, net->output_blobs()[i])].pinned = true;
+
+  size_t pinned_count = 0;
+  std::vector<PlannedBuffer> planned;
+  for (std::map<caffe::Blob<float>*, PlannedBuffer>::iterator it =
+         buffers.begin();
+       it != buffers.end(); ++it) {
+    if (it->second.pinned)
+      pinned_count += it->second.count;
+    else
+      planned.push_back(it->second);
+  }
+  if (caffe::Caffe::mode() != caffe::Caffe::CPU)
+    return std::make_pair(naive * sizeof(float), naive * sizeof(float));
+
+  /* Offsets are kept kPlanAlignment aligned; with the aligned arena every
+   * planned blob starts on a 64-byte boundary. */
+  const size_t align = kPlanAlignment / sizeof(float);
+  std::sort(planned.begin(), planned.end(), CompareBufferSize);
+  size_t total = 0;
+  for (size_t i = 0; i < planned.size(); ++i) {
+    std::vector<std::pair<size_t, size_t> > taken;
+    for (size_t j = 0; j < i; ++j)
+      if (planned[j].first <= planned[i].last &&
+          planned[i].first <= planned[j].last)
+        taken.push_back(std::make_pair(planned[j].offset,
+                                       planned[j].offset + planned[j].count));
+    std::sort(taken.begin(), taken.end());
+    size_t offset = 0;
+    for (size_t j = 0; j < taken.size(); ++j) {
+      if (offset + planned[i].count <= taken[j].first)
+        break;
+      offset = std::max(offset,
+                        (taken[j].second + align - 1) / align * align);
+    }
+    planned[i].offset = offset;
+    total = std::max(total, offset + planned[i].count);
+  }
+
+  /* Point the blobs into the new arena before the old one is released.
+   * Every blob of an alias set is pointed at the buffer, so the tops of
+   * Split and Flatten read the same memory before and after their
+   * forward pass shares it. */
+  PlanArena memory(total);
+  for (size_t i = 0; i < planned.size(); ++i)
+    for (size_t j = 0; j < planned[i].blobs.size(); ++j)
+      planned[i].blobs[j]->set_cpu_data(&memory[planned[i].offset]);
+  arena->swap(memory);
+  return std::make_pair((pinned_count + total) * sizeof(float),
+                        naive * sizeof(float));
+}
+
+/* Check that the forward pass of net, whose memory is planned, is bit
+ * identical to the one of an unplanned network built from param and
+ * sharing the trained layers of net. Both get the same deterministic
+ * input, and net runs twice so that a buffer reused across passes shows
+ * up as well. */
+static bool ForwardMatchesUnplanned(const caffe::NetParameter& param,
+                                    caffe::Net<float>* net) {
+  caffe::Net<float> reference(param);
+  reference.ShareTrainedLayersWith(net);
+  for (size_t i = 0; i < net->input_blobs().size(); ++i) {
+    caffe::Blob<float>* input = net->input_blobs()[i];
+    caffe::Blob<float>* reference_input = reference.input_blobs()[i];
+    reference_input->ReshapeLike(*input);
+    float* data = input->mutable_cpu_data();
+    for (int k = 0; k < input->count(); ++k)
+      data[k] = (float) ((k * 2654435761u) >> 22) / 512 - 1;
+    std::copy(input->cpu_data(), input->cpu_data() + input->count(),
+              reference_input->mutable_cpu_data());
+  }
+  reference.Reshape();
+
+  reference.Forward();
+  net->Forward();
+  net->Forward();
+  for (size_t i = 0; i < net->output_blobs().size(); ++i) {
+    const caffe::Blob<float>* output = net->output_blobs()[i];
+    const caffe::Blob<float>* expected = reference.output_blobs()[i];
+    if (output->count() != expected->count() ||
+        memcmp(output->cpu_data(), expected->cpu_data(),
+               output->count() * sizeof(float)) != 0)
+      return false;
+  }
+  return true;
+}
+
+#endif  // COMMON_MEMORY_PLAN_H_
@@ -0,0 +1,132 @@
+#ifndef COMMON_PREPROCESS_H_
+#define COMMON_PREPROCESS_H_
+
+#include <algorithm>
+#include <vector>
+
+#include <caffe/caffe.hpp>
+#include <opencv2/core/core.hpp>
+
+/* Horizontal pass of PreprocessFused for one source row: bilinear
+ * resampling along x and channel conversion, written as one float plane
+ * per converted channel so the vertical pass runs on contiguous data. */
+static void ResampleRow(const uchar* src, int src_channels, int num_planes,
+                        const std::vector<int>& xofs,
+                        const std::vector<float>& xalpha,
+                        int width, float* planes) {
+  float* p0 = planes;
+  float* p1 = planes + width;
+  float* p2 = planes + 2 * width;
+  for (int x = 0; x < width; ++x) {
+    const uchar* s0 = src + xofs[2 * x];
+    const uchar* s1 = src + xofs[2 * x + 1];
+    const float a = xalpha[x];
+    if (num_planes == 3) {
+      p0[x] = s0[0] + a * (s1[0] - s0[0]);
+      p1[x] = s0[1] + a * (s1[1] - s0[1]);
+      p2[x] = s0[2] + a * (s1[2] - s0[2]);
+    } else if (src_channels == 1) {
+      p0[x] = s0[0] + a * (s1[0] - s0[0]);
+    } else {
+      /* Same weights as cv::COLOR_BGR2GRAY. */
+      const float g0 = 0.114f * s0[0] + 0.587f * s0[1] + 0.299f * s0[2];
+      const float g1 = 0.114f * s1[0] + 0.587f * s1[1] + 0.299f * s1[2];
+      p0[x] = g0 + a * (g1 - g0);
+    }
+  }
+}
+
+/* Convert an 8-bit BGR, BGRA or grayscale image into the planar float
+ * channels wrapping the input layer in a single pass. Channel conversion,
+ * bilinear resize (same sampling grid as cv::resize with INTER_LINEAR),
+ * mean subtraction and scaling are fused, so no full-size intermediate
+ * cv::Mat is allocated. Only two resampled source rows are kept. 16-bit
+ * images are scaled down to the 8-bit range the mean is given in; other
+ * depths are rejected rather than saturated. */
+static void PreprocessFused(const cv::Mat& img, const float* mean, float scale,
+                            const cv::Mat* input_channels, int num_channels) {
+  cv::Mat src = img;
+  if (img.depth() == CV_16U)
+    img.convertTo(src, CV_8U, 1. / 257);
+  CHECK(src.depth() == CV_8U)
+    << "Input image should have 8 or 16 bits per channel.";
+  const int src_channels = src.channels();
+  CHECK(src_channels == 1 || src_channels == 3 || src_channels == 4)
+    << "Input image should have 1, 3 or 4 channels.";
+
+  const int width = input_channels[0].cols;
+  const int height = input_channels[0].rows;
+  const int num_planes = (src_channels == 1 || num_channels == 1) ? 1 : 3;
+
+  /* Source column offsets and weights, shared by every row. */
+  const double scale_x = (double) src.cols / width;
+  std::vector<int> xofs(2 * width);
+  std::vector<float> xalpha(width);
+  for (int x = 0; x < width; ++x) {
+    float fx = (float) ((x + 0.5) * scale_x - 0.5);
+    int sx = cvFloor(fx);
+    fx -= sx;
+    if (sx < 0) {
+      sx = 0;
+      fx = 0.f;
+    }
+    if (sx >= src.cols - 1) {
+      sx = src.cols - 1;
+      fx = 0.f;
+    }
+    xofs[2 * x] = sx * src_channels;
+    xofs[2 * x + 1] = std::min(sx + 1, src.cols - 1) * src_channels;
+    xalpha[x] = fx;
+  }
+
+  /* Two resampled source rows; consecutive output rows usually share
+   * one of them, in which case it is not resampled again. */
+  std::vector<float> rows(2 * num_planes * width);
+  float* row_buf[2] = { &rows[0], &rows[num_planes * width] };
+  int row_index[2] = { -1, -1 };
+
+  const double scale_y = (double) src.rows / height;
+  for (int y = 0; y < height; ++y) {
+    float fy = (float) ((y + 0.5) * scale_y - 0.5);
+    int sy = cvFloor(fy);
+    fy -= sy;
+    if (sy < 0) {
+      sy = 0;
+      fy = 0.f;
+    }
+    if (sy >= src.rows - 1) {
+      sy = src.rows - 1;
+      fy = 0.f;
+    }
+    const int sy1 = std::min(sy + 1, src.rows - 1);
+
+    if (row_index[1] == sy) {
+      std::swap(row_buf[0], row_buf[1]);
+      std::swap(row_index[0], row_index[1]);
+    }
+    if (row_index[0] != sy) {
+      ResampleRow(src.ptr<uchar>(sy), src_channels, num_planes,
+                  xofs, xalpha, width, row_buf[0]);
+      row_index[0] = sy;
+    }
+    if (row_index[1] != sy1) {
+      ResampleRow(src.ptr<uchar>(sy1), src_channels, num_planes,
+                  xofs, xalpha, width, row_buf[1]);
+      row_index[1] = sy1;
+    }
+
+    /* Vertical pass, mean subtraction and scaling on contiguous planes. */
+    for (int c = 0; c < num_channels; ++c) {
+      const int plane = std::min(c, num_planes - 1);
+      const float* r0 = row_buf[0] + plane * width;
+      const float* r1 = row_buf[1] + plane * width;
+      const float m = mean[c];
+      float* out =
+        reinterpret_cast<float*>(input_channels[c].data) + y * width;
+      for (int x = 0; x < width; ++x)
+        out[x] = (r0[x] + fy * (r1[x] - r0[x]) - m) * scale;
+    }
+  }
+}
+
+#endif  // COMMON_PREPROCESS_H_
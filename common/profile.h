@@ -0,0 +1,112 @@
+#ifndef COMMON_PROFILE_H_
+#define COMMON_PROFILE_H_
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <caffe/caffe.hpp>
+
+/* Rough floating point operation count of one forward pass of a layer:
+ * two per multiply-accumulate for convolutions and inner products, and
+ * one per output element for everything else. */
+static double EstimateFlops(caffe::Layer<float>* layer,
+                            const std::vector<caffe::Blob<float>*>& bottom,
+                            const std::vector<caffe::Blob<float>*>& top) {
+  const std::string type = layer->type();
+  if (!layer->blobs().empty()) {
+    const caffe::Blob<float>& weights = *layer->blobs()[0];
+    /* Multiply-accumulates per output (convolution) or per input
+     * (deconvolution) element: input channels per group times kernel
+     * area, or output channels per group times kernel area. */
+    const double per_element = (double) weights.count() / weights.shape(0);
+    if (type == "Convolution")
+      return 2.0 * top[0]->count() * per_element;
+    if (type == "Deconvolution")
+      return 2.0 * bottom[0]->count() * per_element;
+    if (type == "InnerProduct")
+      return 2.0 * weights.count() * top[0]->num();
+  }
+  double flops = 0;
+  for (size_t i = 0; i < top.size(); ++i)
+    flops += top[i]->count();
+  return flops;
+}
+
+/* Time the forward pass of every layer of net on its current input over
+ * iterations passes, after one warm-up pass, and print a table sorted by
+ * time with an estimated FLOP count and the bytes of the output blobs. */
+static void ProfileNet(caffe::Net<float>* net, int iterations,
+                       std::ostream* out) {
+  const std::vector<caffe::shared_ptr<caffe::Layer<float> > >& layers =
+    net->layers();
+  const std::vector<std::string>& names = net->layer_names();
+  const int num_layers = layers.size();
+
+  net->ForwardFromTo(0, num_layers - 1);
+  std::vector<double> micros(num_layers, 0);
+  for (int k = 0; k < iterations; ++k) {
+    for (int i = 0; i < num_layers; ++i) {
+      std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+      net->ForwardFromTo(i, i);
+#ifndef CPU_ONLY
+      CUDA_CHECK(cudaDeviceSynchronize());
+#endif
+      micros[i] += std::chrono::duration<double, std::micro>(
+        std::chrono::steady_clock::now() - start).count();
+    }
+  }
+
+  std::vector<int> order(num_layers);
+  double total_micros = 0, total_flops = 0, total_bytes = 0;
+  std::vector<double> flops(num_layers), bytes(num_layers, 0);
+  size_t name_width = 5;
+  for (int i = 0; i < num_layers; ++i) {
+    order[i] = i;
+    micros[i] /= std::max(iterations, 1);
+    flops[i] = EstimateFlops(layers[i].get(), net->bottom_vecs()[i],
+                             net->top_vecs()[i]);
+    for (size_t t = 0; t < net->top_vecs()[i].size(); ++t)
+      bytes[i] += net->top_vecs()[i][t]->count() * sizeof(float);
+    total_micros += micros[i];
+    total_flops += flops[i];
+    total_bytes += bytes[i];
+    name_width = std::max(name_width, names[i].size());
+  }
+  std::sort(order.begin(), order.end(),
+            [&micros](int a, int b) { return micros[a] > micros[b]; });
+
+  std::ostream& o = *out;
+  o << "Per-layer forward time, mean of " << iterations << " passes"
+    << std::endl;
+  o << std::left << std::setw(name_width + 2) << "layer"
+    << std::setw(16) << "type" << std::right
+    << std::setw(10) << "ms" << std::setw(8) << "%"
+    << std::setw(12) << "MFLOP" << std::setw(10) << "GFLOP/s"
+    << std::setw(12) << "output KB" << std::endl;
+  o << std::fixed;
+  for (int n = 0; n < num_layers; ++n) {
+    const int i = order[n];
+    o << std::left << std::setw(name_width + 2) << names[i]
+      << std::setw(16) << layers[i]->type() << std::right
+      << std::setprecision(3) << std::setw(10) << micros[i] / 1000
+      << std::setprecision(1) << std::setw(8)
+      << 100 * micros[i] / std::max(total_micros, 1e-9)
+      << std::setw(12) << flops[i] / 1e6
+      << std::setw(10) << flops[i] / std::max(micros[i], 1e-9) / 1000
+      << std::setw(12) << bytes[i] / 1024 << std::endl;
+  }
+  o << std::left << std::setw(name_width + 2) << "total"
+    << std::setw(16) << "" << std::right
+    << std::setprecision(3) << std::setw(10) << total_micros / 1000
+    << std::setprecision(1) << std::setw(8) << 100.0
+    << std::setw(12) << total_flops / 1e6
+    << std::setw(10) << total_flops / std::max(total_micros, 1e-9) / 1000
+    << std::setw(12) << total_bytes / 1024 << std::endl;
+}
+
+#endif  // COMMON_PROFILE_H_
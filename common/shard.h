@@ -0,0 +1,302 @@
+#ifndef COMMON_SHARD_H_
+#define COMMON_SHARD_H_
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "boost/filesystem.hpp"
+
+/* Packed shard files of the trainers' --shards export and of shard_tool.
+ *
+ * A shard is the magic "SHD1" followed by one record per sample: the
+ * sample name, the encoded image and the binary label record, each as a
+ * uint32 size and the bytes. The sample name is the file name of the
+ * image, extension included, so that it can be unpacked in its original
+ * format. A closed shard ends with its index: the uint64 offset of every
+ * record, then the uint64 offset of the index, the uint32 record count and
+ * the magic "SHDX". A shard that was not closed can still be read
+ * sequentially. The binary label record is the uint32 number of objects
+ * and, per object, the fields of its text label line: the class (uint8
+ * size and bytes) and the numbers (uint8 count and floats). */
+
+static const char kShardMagic[4] = { 'S', 'H', 'D', '1' };
+static const char kShardIndexMagic[4] = { 'S', 'H', 'D', 'X' };
+
+/* Binary label record of the lines of a text label file. */
+static std::string EncodeLabels(const std::string& text) {
+  std::istringstream lines(text);
+  std::string record(sizeof(uint32_t), '\0');  // object count, set below
+  uint32_t count = 0;
+  std::string line;
+  while (std::getline(lines, line)) {
+    std::istringstream fields(line);
+    std::string name;
+    if (!(fields >> name))
+      continue;
+    std::vector<float> values;
+    float value;
+    while (values.size() < 255 && fields >> value)
+      values.push_back(value);
+    name.resize(std::min<size_t>(name.size(), 255));
+    record.push_back((char) name.size());
+    record.append(name);
+    record.push_back((char) values.size());
+    record.append(reinterpret_cast<const char*>(values.data()),
+                  values.size() * sizeof(float));
+    ++count;
+  }
+  memcpy(&record[0], &count, sizeof(count));
+  return record;
+}
+
+/* Text label file of a binary label record, one line per object as the
+ * trainers write it. */
+static std::string DecodeLabels(const std::string& record) {
+  std::ostringstream text;
+  uint32_t count = 0;
+  if (record.size() < sizeof(count))
+    return "";
+  memcpy(&count, record.data(), sizeof(count));
+  size_t pos = sizeof(count);
+  for (uint32_t i = 0; i < count && pos < record.size(); ++i) {
+    const size_t name_size = (uint8_t) record[pos++];
+    if (pos + name_size >= record.size())
+      break;
+    text << record.substr(pos, name_size);
+    pos += name_size;
+    const size_t num_values = (uint8_t) record[pos++];
+    if (pos + num_values * sizeof(float) > record.size())
+      break;
+    for (size_t j = 0; j < num_values; ++j) {
+      float value;
+      memcpy(&value, &record[pos], sizeof(value));
+      pos += sizeof(value);
+      text << " " << value;
+    }
+    text << "\n";
+  }
+  return text.str();
+}
+
+/* Extension of the encoded image of a record: the image extension of its
+ * name or, for records written before names kept it, the one matching
+ * the magic bytes of the image. */
+static std::string ShardImageExtension(const std::string& name,
+                                       const std::string& image) {
+  static const char* extensions[] = {
+    ".jpg", ".jpeg", ".png", ".bmp", ".ppm", ".pgm", ".tif", ".tiff"
+  };
+  const std::string ext = boost::filesystem::path(name).extension().string();
+  std::string lower = ext;
+  std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+  for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); ++i)
+    if (lower == extensions[i])
+      return ext;
+  if (image.compare(0, 8, "\x89PNG\r\n\x1a\n") == 0)
+    return ".png";
+  if (image.compare(0, 2, "BM") == 0)
+    return ".bmp";
+  if (image.compare(0, 4, "II*\0", 4) == 0 ||
+      image.compare(0, 4, "MM\0*", 4) == 0)
+    return ".tif";
+  if (image.size() >= 3 && image[0] == 'P' && image[1] >= '1' &&
+      image[1] <= '6')
+    return image[1] == '5' || image[1] == '2' ? ".pgm" : ".ppm";
+  return ".jpg";
+}
+
+struct ShardRecord {
+  std::string name;    // image file name
+  std::string image;   // encoded, as exported
+  std::string labels;  // binary label record
+};
+
+/* Reads the records of a shard in order, at disk bandwidth. The index of
+ * a closed shard gives the record count and random access; a shard whose
+ * writer did not close it is read up to its last complete record. */
+class ShardReader {
+ public:
+  ShardReader() : end_(0) {}
+
+  bool Open(const std::string& path) {
+    file_.open(path.c_str(), std::ios::in | std::ios::binary);
+    char magic[4];
+    if (!file_.read(magic, sizeof(magic)) ||
+        memcmp(magic, kShardMagic, sizeof(magic)) != 0)
+      return false;
+
+    file_.seekg(0, std::ios::end);
+    end_ = file_.tellg();
+    ReadIndex();
+    file_.clear();
+    file_.seekg(sizeof(kShardMagic));
+    return true;
+  }
+
+  /* Number of records per the index; 0 for a shard that was not
+   * closed. */
+  size_t num_records() const { return index_.size(); }
+
+  bool Seek(size_t record) {
+    if (record >= index_.size())
+      return false;
+    file_.clear();
+    file_.seekg(index_[record]);
+    return true;
+  }
+
+  bool Next(ShardRecord* record) {
+    return (uint64_t) file_.tellg() < end_ &&
+           ReadField(&record->name) &&
+           ReadField(&record->image) &&
+           ReadField(&record->labels);
+  }
+
+ private:
+  /* Load the index of a closed shard; end_ is moved to the end of the
+   * records. */
+  void ReadIndex() {
+    if (end_ < sizeof(kShardMagic) + sizeof(uint64_t) + sizeof(uint32_t) +
+               sizeof(kShardIndexMagic))
+      return;
+    uint64_t index_offset;
+    uint32_t count;
+    char magic[4];
+    file_.seekg(end_ - sizeof(magic) - sizeof(count) - sizeof(index_offset));
+    file_.read(reinterpret_cast<char*>(&index_offset), sizeof(index_offset));
+    file_.read(reinterpret_cast<char*>(&count), sizeof(count));
+    file_.read(magic, sizeof(magic));
+    if (!file_ || memcmp(magic, kShardIndexMagic, sizeof(magic)) != 0 ||
+        index_offset + count * sizeof(uint64_t) + sizeof(index_offset) +
+        sizeof(count) + sizeof(magic) != end_)
+      return;
+    index_.resize(count);
+    file_.seekg(index_offset);
+    file_.read(reinterpret_cast<char*>(index_.data()),
+               count * sizeof(uint64_t));
+    if (!file_)
+      index_.clear();
+    else
+      end_ = index_offset;
+  }
+
+  bool ReadField(std::string* field) {
+    uint32_t size;
+    if (!file_.read(reinterpret_cast<char*>(&size), sizeof(size)) ||
+        (uint64_t) file_.tellg() + size > end_)
+      return false;
+    field->resize(size);
+    return size == 0 || file_.read(&(*field)[0], size);
+  }
+
+  std::ifstream file_;
+  std::vector<uint64_t> index_;
+  uint64_t end_;
+};
+
+/* Appends records to shards <dir>/<prefix>NNNNN.shard and starts the next
+ * shard once a shard reaches size_cap bytes. Existing shards are never
+ * overwritten. A shard whose write failed is closed without an index and
+ * the next Append starts a new one. Append may be called from several
+ * threads. */
+class ShardWriter {
+ public:
+  ShardWriter(const std::string& dir, const std::string& prefix,
+              uint64_t size_cap)
+    : dir_(dir), prefix_(prefix), size_cap_(size_cap), offset_(0),
+      number_(0), num_shards_(0) {}
+
+  ~ShardWriter() { Close(); }
+
+  bool Append(const ShardRecord& record) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const uint64_t size = 3 * sizeof(uint32_t) + record.name.size() +
+                          record.image.size() + record.labels.size();
+    if (file_.is_open() && !index_.empty() && offset_ + size > size_cap_)
+      CloseShard();
+    if (!file_.is_open() && !OpenShard())
+      return false;
+    const uint64_t offset = offset_;
+    WriteField(record.name);
+    WriteField(record.image);
+    WriteField(record.labels);
+    /* Flushed per record, so that a failed write shows before the record
+     * is indexed rather than when the shard is closed. */
+    file_.flush();
+    if (!file_.good()) {
+      /* The record may be partly written: close the shard without an
+       * index, so that readers stop at its last complete record. */
+      file_.close();
+      index_.clear();
+      return false;
+    }
+    index_.push_back(offset);
+    return true;
+  }
+
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (file_.is_open())
+      CloseShard();
+  }
+
+  int num_shards() const { return num_shards_; }
+
+ private:
+  bool OpenShard() {
+    boost::system::error_code error;
+    boost::filesystem::create_directories(dir_, error);
+    char path[512];
+    do {
+      snprintf(path, sizeof(path), "%s/%s%05d.shard", dir_.c_str(),
+               prefix_.c_str(), number_++);
+    } while (boost::filesystem::exists(path));
+    file_.open(path, std::ios::out | std::ios::binary);
+    if (!file_)
+      return false;
+    file_.write(kShardMagic, sizeof(kShardMagic));
+    offset_ = sizeof(kShardMagic);
+    ++num_shards_;
+    return true;
+  }
+
+  void CloseShard() {
+    const uint64_t index_offset = offset_;
+    const uint32_t count = index_.size();
+    file_.write(reinterpret_cast<const char*>(index_.data()),
+                index_.size() * sizeof(uint64_t));
+    file_.write(reinterpret_cast<const char*>(&index_offset),
+                sizeof(index_offset));
+    file_.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    file_.write(kShardIndexMagic, sizeof(kShardIndexMagic));
+    file_.close();
+    index_.clear();
+  }
+
+  void WriteField(const std::string& field) {
+    const uint32_t size = field.size();
+    file_.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    file_.write(field.data(), size);
+    offset_ += sizeof(size) + size;
+  }
+
+  std::mutex mutex_;
+  std::ofstream file_;
+  std::string dir_;
+  std::string prefix_;
+  uint64_t size_cap_;
+  uint64_t offset_;
+  std::vector<uint64_t> index_;
+  int number_;
+  int num_shards_;
+};
+
+#endif  // COMMON_SHARD_H_
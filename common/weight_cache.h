@@ -0,0 +1,231 @@
+#ifndef COMMON_WEIGHT_CACHE_H_
+#define COMMON_WEIGHT_CACHE_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <caffe/caffe.hpp>
+
+#include "common/fold_layers.h"
+
+/* Memory mapping of a weight cache, unmapped once the engine that bound
+ * its parameter blobs to it goes away. */
+struct WeightMap {
+  WeightMap(char* addr, size_t size) : addr(addr), size(size) {}
+  ~WeightMap() { munmap(addr, size); }
+
+  char* addr;
+  size_t size;
+};
+
+/* A weight cache is a flat copy of the parameter blobs of a net, kept
+ * next to the .caffemodel it was converted from, with the BatchNorm and
+ * Scale layers already folded (see NetFold). It starts with a
+ * WeightCacheHeader, followed by one WeightCacheEntry per parameter blob
+ * in layer order and the float data of the blobs, each aligned to
+ * kWeightCacheAlign bytes. */
+static const char kWeightCacheMagic[4] = { 'C', 'W', 'C', '2' };
+static const uint64_t kWeightCacheAlign = 64;
+
+struct WeightCacheHeader {
+  char magic[4];
+  uint32_t num_blobs;
+  int64_t source_size;   // size and mtime of the .caffemodel
+  int64_t source_mtime;
+  uint64_t fold_key;     // NetFold::key of the folded weights
+};
+
+struct WeightCacheEntry {
+  char layer[64];        // layer name, truncated
+  uint32_t index;        // blob index within the layer
+  uint32_t reserved;
+  uint64_t count;
+  uint64_t offset;       // from the start of the file
+};
+
+static std::string WeightCacheFile(const std::string& trained_file) {
+  return trained_file + ".wcache";
+}
+
+/* Bind the parameter blobs of net to the weight cache of trained_file.
+ * The cache is mapped copy-on-write, so the pages stay shared with every
+ * other process using the same model unless a blob is written to. Return
+ * null, leaving net untouched, unless the cache is up to date, was folded
+ * the same way and matches the layers of net. */
+static caffe::shared_ptr<WeightMap> MapWeightCache(
+    caffe::Net<float>* net, const std::string& trained_file,
+    uint64_t fold_key) {
+  const std::string cache_file = WeightCacheFile(trained_file);
+  struct stat source, cache;
+  if (stat(trained_file.c_str(), &source) != 0 ||
+      stat(cache_file.c_str(), &cache) != 0 ||
+      (size_t) cache.st_size < sizeof(WeightCacheHeader))
+    return caffe::shared_ptr<WeightMap>();
+
+  int fd = open(cache_file.c_str(), O_RDONLY);
+  if (fd < 0)
+    return caffe::shared_ptr<WeightMap>();
+  void* addr = mmap(NULL, cache.st_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    return caffe::shared_ptr<WeightMap>();
+  caffe::shared_ptr<WeightMap> map(
+    new WeightMap(static_cast<char*>(addr), cache.st_size));
+
+  const WeightCacheHeader* header =
+    reinterpret_cast<const WeightCacheHeader*>(map->addr);
+  if (memcmp(header->magic, kWeightCacheMagic, sizeof(header->magic)) != 0 ||
+      header->source_size != (int64_t) source.st_size ||
+      header->source_mtime != (int64_t) source.st_mtime ||
+      header->fold_key != fold_key ||
+      sizeof(*header) + header->num_blobs * sizeof(WeightCacheEntry) >
+        map->size)
+    return caffe::shared_ptr<WeightMap>();
+  const WeightCacheEntry* entries =
+    reinterpret_cast<const WeightCacheEntry*>(header + 1);
+
+  /* Check every blob before binding any. */
+  std::vector<std::pair<caffe::Blob<float>*, float*> > bindings;
+  const std::vector<caffe::shared_ptr<caffe::Layer<float> > >& layers =
+    net->layers();
+  for (size_t i = 0; i < layers.size(); ++i) {
+    const std::string& name = net->layer_names()[i];
+    for (size_t j = 0; j < layers[i]->blobs().size(); ++j) {
+      caffe::Blob<float>* blob = layers[i]->blobs()[j].get();
+      if (bindings.size() >= header->num_blobs)
+        return caffe::shared_ptr<WeightMap>();
+      const WeightCacheEntry& e = entries[bindings.size()];
+      if (strncmp(e.layer, name.c_str(), sizeof(e.layer)) != 0 ||
+          e.index != j || e.count != (uint64_t) blob->count() ||
+          e.offset % kWeightCacheAlign != 0 ||
+          e.offset + e.count * sizeof(float) > map->size)
+        return caffe::shared_ptr<WeightMap>();
+      bindings.push_back(std::make_pair(
+        blob, reinterpret_cast<float*>(map->addr + e.offset)));
+    }
+  }
+  if (bindings.size() != header->num_blobs)
+    return caffe::shared_ptr<WeightMap>();
+
+  for (size_t k = 0; k < bindings.size(); ++k)
+    bindings[k].first->set_cpu_data(bindings[k].second);
+  return map;
+}
+
+/* Convert the parameter blobs of net into the weight cache of
+ * trained_file. The cache is written under a temporary name and renamed,
+ * so concurrent readers never see a partial file. */
+static bool WriteWeightCache(caffe::Net<float>* net,
+                             const std::string& trained_file,
+                             uint64_t fold_key) {
+  struct stat source;
+  if (stat(trained_file.c_str(), &source) != 0)
+    return false;
+
+  std::vector<WeightCacheEntry> entries;
+  std::vector<const caffe::Blob<float>*> blobs;
+  const std::vector<caffe::shared_ptr<caffe::Layer<float> > >& layers =
+    net->layers();
+  for (size_t i = 0; i < layers.size(); ++i) {
+    for (size_t j = 0; j < layers[i]->blobs().size(); ++j) {
+      WeightCacheEntry e;
+      memset(&e, 0, sizeof(e));
+      strncpy(e.layer, net->layer_names()[i].c_str(), sizeof(e.layer));
+      e.index = j;
+      e.count = layers[i]->blobs()[j]->count();
+      entries.push_back(e);
+      blobs.push_back(layers[i]->blobs()[j].get());
+    }
+  }
+
+  WeightCacheHeader header;
+  memcpy(header.magic, kWeightCacheMagic, sizeof(header.magic));
+  header.num_blobs = entries.size();
+  header.source_size = source.st_size;
+  header.source_mtime = source.st_mtime;
+  header.fold_key = fold_key;
+
+  uint64_t offset = sizeof(header) + entries.size() * sizeof(entries[0]);
+  for (size_t k = 0; k < entries.size(); ++k) {
+    offset = (offset + kWeightCacheAlign - 1) / kWeightCacheAlign *
+             kWeightCacheAlign;
+    entries[k].offset = offset;
+    offset += entries[k].count * sizeof(float);
+  }
+
+  const std::string cache_file = WeightCacheFile(trained_file);
+  std::ostringstream temp_name;
+  temp_name << cache_file << ".tmp." << getpid();
+  const std::string temp_file = temp_name.str();
+  std::ofstream out(temp_file.c_str(), std::ios::out | std::ios::binary);
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  if (!entries.empty())
+    out.write(reinterpret_cast<const char*>(&entries[0]),
+              entries.size() * sizeof(entries[0]));
+  static const char padding[kWeightCacheAlign] = { 0 };
+  for (size_t k = 0; k < entries.size(); ++k) {
+    out.write(padding, entries[k].offset - out.tellp());
+    out.write(reinterpret_cast<const char*>(blobs[k]->cpu_data()),
+              entries[k].count * sizeof(float));
+  }
+  out.close();
+  if (!out || rename(temp_file.c_str(), cache_file.c_str()) != 0) {
+    unlink(temp_file.c_str());
+    return false;
+  }
+  return true;
+}
+
+/* Load the trained weights of *net, built from *param, through the
+ * weight cache of trained_file and rewrite both for inference, see
+ * NetFold. The cache holds the folded weights, so the folded convolutions
+ * are mapped like every other layer. The .caffemodel is only deserialized
+ * when the cache is missing or stale; it is then folded, converted and
+ * the blobs are rebound to the new cache. Return the mapping backing the
+ * blobs, or null if the weights could only be loaded into private
+ * memory. */
+static caffe::shared_ptr<WeightMap> LoadTrainedWeights(
+    caffe::NetParameter* param, caffe::shared_ptr<caffe::Net<float> >* net,
+    const std::string& trained_file) {
+  NetFold fold;
+  FoldParam(*param, net->get(), &fold);
+  caffe::shared_ptr<caffe::Net<float> > folded = *net;
+  if (!fold.empty())
+    folded.reset(new caffe::Net<float>(fold.param));
+
+  caffe::shared_ptr<WeightMap> map =
+    MapWeightCache(folded.get(), trained_file, fold.key);
+  if (!map) {
+    (*net)->CopyTrainedLayersFrom(trained_file);
+    if (!fold.empty()) {
+      FoldParam(*param, net->get(), &fold);
+      FoldWeights(fold, net->get(), folded.get());
+    }
+    if (WriteWeightCache(folded.get(), trained_file, fold.key))
+      map = MapWeightCache(folded.get(), trained_file, fold.key);
+    else
+      LOG(WARNING) << "Unable to write weight cache "
+                   << WeightCacheFile(trained_file);
+  }
+
+  if (!fold.empty()) {
+    LOG(INFO) << "Folded " << fold.num_folded << " BatchNorm/Scale layers "
+              << "into " << fold.folds.size() << " convolutions, "
+              << fold.num_relus << " ReLUs made in place.";
+    param->CopyFrom(fold.param);
+    *net = folded;
+  }
+  return map;
+}
+
+#endif  // COMMON_WEIGHT_CACHE_H_
@@ -4,60 +4,187 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #endif  // USE_OPENCV
+#include <sys/stat.h>
+#include <unistd.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
 #include <iosfwd>
+#include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
+#include "common/bench.h"
+#include "common/image_files.h"
+#include "common/int8_layers.h"
+#include "common/latency.h"
+#include "common/memory_plan.h"
+#include "common/preprocess.h"
+#include "common/profile.h"
+#include "common/weight_cache.h"
+
 #ifdef USE_OPENCV
 using namespace caffe;  // NOLINT(build/namespaces)
 using std::string;
 
+DEFINE_int32(batch_size, 16,
+    "Number of images per forward pass in directory/list mode.");
+DEFINE_int32(decode_threads, 4,
+    "Number of image decode threads in directory/list mode.");
+DEFINE_int32(inference_threads, 1,
+    "Number of concurrent forward passes in directory/list mode; each "
+    "thread gets its own network instance sharing the trained weights.");
+DEFINE_int32(queue_size, 64,
+    "Maximum number of decoded images waiting for the classifier.");
+DEFINE_int32(top_k, 5,
+    "Number of predictions reported per image.");
+DEFINE_string(output, "",
+    "Result file for directory/list mode; standard output if empty.");
+DEFINE_string(format, "csv",
+    "Result format for directory/list mode: csv or jsonl.");
+DEFINE_bool(bench, false,
+    "Benchmark the engine on the input images instead of classifying; SYNTHETIC "
+    "as the image argument selects a fixed synthetic image set.");
+DEFINE_int32(bench_images, 256,
+    "Number of images timed per benchmark configuration.");
+DEFINE_int32(bench_warmup, 4,
+    "Untimed batches per thread before each benchmark configuration.");
+DEFINE_int32(bench_max_batch, 16,
+    "Largest benchmarked batch size.");
+DEFINE_int32(bench_max_threads, 0,
+    "Largest benchmarked thread count; the number of cores if 0.");
+DEFINE_string(bench_output, "bench_output.txt",
+    "File the benchmark results are appended to, one JSON object per "
+    "line.");
+DEFINE_int32(profile, 0,
+    "If positive, time each layer over this many forward passes on the "
+    "input image and print a per-layer table instead of classifying.");
+DEFINE_string(int8_calibration, "",
+    "If set, run the convolution and inner product layers in int8 on the "
+    "CPU, calibrated on the images of this directory, e.g. "
+    "./training_data/images.");
+DEFINE_int32(int8_calibration_images, 100,
+    "Maximum number of calibration images, spread over the directory.");
+DEFINE_bool(memory_report, false,
+    "Print the host memory of the intermediate blobs, planned and with one "
+    "buffer per blob, after setup.");
+DEFINE_bool(memory_check, false,
+    "Check after setup that a forward pass with the planned intermediate "
+    "memory is bit identical to one without, and exit with an error if "
+    "not.");
+DEFINE_bool(int8_report, false,
+    "Compare the int8 path against the float path on the input images and "
+    "print an accuracy-vs-speed report instead of classifying.");
+
 /* Pair (label, confidence) representing a prediction. */
 typedef std::pair<string, float> Prediction;
 
+/* The Caffe mode is thread-local, so every thread that runs a forward
+ * pass has to set it. */
+static void SetCaffeMode() {
+#ifdef CPU_ONLY
+  Caffe::set_mode(Caffe::CPU);
+#else
+  Caffe::set_mode(Caffe::GPU);
+#endif
+}
+
+/* A network of the engine's instance pool together with the channel
+ * views bound to its input layer. */
+struct NetInstance {
+  shared_ptr<Net<float> > net;
+  std::vector<cv::Mat> input_channels;
+  PlanArena arena;  // intermediate blobs, see PlanMemory
+  std::pair<size_t, size_t> memory;  // planned and naive bytes
+};
+
 class Classifier {
  public:
   Classifier(const string& model_file,
              const string& trained_file,
              const string& mean_file,
-             const string& label_file);
+             const string& label_file,
+             int num_instances = 1);
 
   std::vector<Prediction> Classify(const cv::Mat& img, int N = 5);
 
+  std::vector<std::vector<Prediction> > ClassifyBatch(
+      const std::vector<cv::Mat>& imgs, int N = 5);
+
+  void ProfileLayers(const cv::Mat& img, int iterations,
+                     std::ostream* out);
+
+  std::pair<size_t, size_t> EnableInt8(
+      const std::vector<string>& calibration_files);
+
+  std::pair<size_t, size_t> ActivationMemory();
+
+  bool CheckMemoryPlan();
+
+  /* Latency histograms of the engine stages. Tools record their own
+   * decode and render samples into the same stats. */
+  LatencyStats* latency() { return &latency_; }
+
  private:
   void SetMean(const string& mean_file);
 
   std::vector<float> Predict(const cv::Mat& img);
 
-  void WrapInputLayer(std::vector<cv::Mat>* input_channels);
+  std::vector<float> PredictBatch(const std::vector<cv::Mat>& imgs);
+
+  void CreateInstancePool(const NetParameter& net_param, int num_instances);
+
+  NetInstance* AcquireInstance();
 
-  void Preprocess(const cv::Mat& img,
-                  std::vector<cv::Mat>* input_channels);
+  void ReleaseInstance(NetInstance* instance);
+
+  void BindInputLayer(NetInstance* instance, int batch_size);
+
+  void WrapInputLayer(Net<float>* net, std::vector<cv::Mat>* input_channels);
+
+  void Preprocess(const cv::Mat& img, const cv::Mat* input_channels);
 
  private:
-  shared_ptr<Net<float> > net_;
+  NetParameter net_param_;
+  shared_ptr<Net<float> > net_;  // first instance, owns the trained weights
+  shared_ptr<WeightMap> weights_;  // weight cache backing net_, if any
   cv::Size input_geometry_;
   int num_channels_;
-  cv::Mat mean_;
+  std::vector<shared_ptr<NetInstance> > instances_;
+  std::vector<NetInstance*> free_instances_;
+  std::mutex pool_mutex_;
+  std::condition_variable pool_cond_;
+  cv::Scalar mean_;
   std::vector<string> labels_;
+  LatencyStats latency_;
 };
 
 Classifier::Classifier(const string& model_file,
                        const string& trained_file,
                        const string& mean_file,
-                       const string& label_file) {
-#ifdef CPU_ONLY
-  Caffe::set_mode(Caffe::CPU);
-#else
-  Caffe::set_mode(Caffe::GPU);
-#endif
+                       const string& label_file,
+                       int num_instances) {
+  SetCaffeMode();
 
   /* Load the network. */
-  net_.reset(new Net<float>(model_file, TEST));
-  net_->CopyTrainedLayersFrom(trained_file);
+  ReadNetParamsFromTextFileOrDie(model_file, &net_param_);
+  net_param_.mutable_state()->set_phase(TEST);
+  net_.reset(new Net<float>(net_param_));
+  weights_ = LoadTrainedWeights(&net_param_, &net_, trained_file);
 
   CHECK_EQ(net_->num_inputs(), 1) << "Network should have exactly one input.";
   CHECK_EQ(net_->num_outputs(), 1) << "Network should have exactly one output.";
@@ -68,6 +195,8 @@ Classifier::Classifier(const string& model_file,
     << "Input layer should have 1 or 3 channels.";
   input_geometry_ = cv::Size(input_layer->width(), input_layer->height());
 
+  CreateInstancePool(net_param_, num_instances);
+
   /* Load the binaryproto mean file. */
   SetMean(mean_file);
 
@@ -104,6 +233,7 @@ static std::vector<int> Argmax(const std::vector<float>& v, int N) {
 /* Return the top N predictions. */
 std::vector<Prediction> Classifier::Classify(const cv::Mat& img, int N) {
   std::vector<float> output = Predict(img);
+  ScopedLatency probe(&latency_, kPostprocess);
 
   N = std::min<int>(labels_.size(), N);
   std::vector<int> maxN = Argmax(output, N);
@@ -116,6 +246,34 @@ std::vector<Prediction> Classifier::Classify(const cv::Mat& img, int N) {
   return predictions;
 }
 
+/* Return the top N predictions for each image of the batch. All images
+ * go through a single forward pass of the network. */
+std::vector<std::vector<Prediction> > Classifier::ClassifyBatch(
+    const std::vector<cv::Mat>& imgs, int N) {
+  std::vector<std::vector<Prediction> > all_predictions;
+  if (imgs.empty())
+    return all_predictions;
+
+  std::vector<float> output = PredictBatch(imgs);
+  ScopedLatency probe(&latency_, kPostprocess);
+
+  N = std::min<int>(labels_.size(), N);
+  const size_t num_outputs = output.size() / imgs.size();
+  for (size_t j = 0; j < imgs.size(); ++j) {
+    std::vector<float> scores(output.begin() + j * num_outputs,
+                              output.begin() + (j + 1) * num_outputs);
+    std::vector<int> maxN = Argmax(scores, N);
+    std::vector<Prediction> predictions;
+    for (int i = 0; i < N; ++i) {
+      int idx = maxN[i];
+      predictions.push_back(std::make_pair(labels_[idx], scores[idx]));
+    }
+    all_predictions.push_back(predictions);
+  }
+
+  return all_predictions;
+}
+
 /* Load the mean file in binaryproto format. */
 void Classifier::SetMean(const string& mean_file) {
   BlobProto blob_proto;
@@ -141,45 +299,136 @@ void Classifier::SetMean(const string& mean_file) {
   cv::Mat mean;
   cv::merge(channels, mean);
 
-  /* Compute the global mean pixel value and create a mean image
-   * filled with this value. */
-  cv::Scalar channel_mean = cv::mean(mean);
-  mean_ = cv::Mat(input_geometry_, mean.type(), channel_mean);
+  /* Compute the global mean pixel value, subtracted from every
+   * input pixel during preprocessing. */
+  mean_ = cv::mean(mean);
 }
 
 std::vector<float> Classifier::Predict(const cv::Mat& img) {
-  Blob<float>* input_layer = net_->input_blobs()[0];
-  input_layer->Reshape(1, num_channels_,
-                       input_geometry_.height, input_geometry_.width);
-  /* Forward dimension change to all layers. */
-  net_->Reshape();
+  return PredictBatch(std::vector<cv::Mat>(1, img));
+}
 
-  std::vector<cv::Mat> input_channels;
-  WrapInputLayer(&input_channels);
+std::vector<float> Classifier::PredictBatch(const std::vector<cv::Mat>& imgs) {
+  NetInstance* instance = AcquireInstance();
+  const int batch_size = imgs.size();
+  BindInputLayer(instance, batch_size);
 
-  Preprocess(img, &input_channels);
+  /* Each image fills its own num_channels_ planes of the input blob. */
+  {
+    ScopedLatency probe(&latency_, kPreprocess);
+    for (int i = 0; i < batch_size; ++i)
+      Preprocess(imgs[i], &instance->input_channels[i * num_channels_]);
+  }
 
-  net_->Forward();
+  /* Reading the output on the host waits for the device, so the forward
+   * time covers the whole network. */
+  Blob<float>* output_layer = instance->net->output_blobs()[0];
+  {
+    ScopedLatency probe(&latency_, kForward);
+    instance->net->Forward();
+    output_layer->cpu_data();
+  }
 
-  /* Copy the output layer to a std::vector */
-  Blob<float>* output_layer = net_->output_blobs()[0];
+  /* Copy the output layer to a std::vector, one row of
+   * output_layer->channels() scores per image. */
   const float* begin = output_layer->cpu_data();
-  const float* end = begin + output_layer->channels();
-  return std::vector<float>(begin, end);
+  const float* end = begin + batch_size * output_layer->channels();
+  std::vector<float> output(begin, end);
+
+  ReleaseInstance(instance);
+  return output;
+}
+
+/* Create the pool of num_instances networks. The first one is net_;
+ * the others share its trained parameters through ShareTrainedLayersWith,
+ * so the weights are held in memory once. Each instance has its own
+ * activations and input binding and can run a forward pass concurrently
+ * with the others. */
+void Classifier::CreateInstancePool(const NetParameter& net_param,
+                                    int num_instances) {
+  CHECK_GE(num_instances, 1) << "Need at least one network instance.";
+  for (int i = 0; i < num_instances; ++i) {
+    shared_ptr<NetInstance> instance(new NetInstance);
+    if (i == 0) {
+      instance->net = net_;
+    } else {
+      instance->net.reset(new Net<float>(net_param));
+      instance->net->ShareTrainedLayersWith(net_.get());
+    }
+    BindInputLayer(instance.get(), 1);
+    instances_.push_back(instance);
+    free_instances_.push_back(instance.get());
+  }
+
+#ifndef CPU_ONLY
+  /* Sync the shared parameters to the GPU up front so that concurrent
+   * first forward passes don't race on the host-to-device copy. */
+  const vector<shared_ptr<Blob<float> > >& params = net_->params();
+  for (size_t i = 0; i < params.size(); ++i)
+    params[i]->gpu_data();
+#endif
+}
+
+/* Hand out a free instance of the pool, waiting until one is released
+ * if all of them are busy. */
+NetInstance* Classifier::AcquireInstance() {
+  std::unique_lock<std::mutex> lock(pool_mutex_);
+  pool_cond_.wait(lock, [this] { return !free_instances_.empty(); });
+  NetInstance* instance = free_instances_.back();
+  free_instances_.pop_back();
+  lock.unlock();
+
+  SetCaffeMode();
+  return instance;
+}
+
+void Classifier::ReleaseInstance(NetInstance* instance) {
+  std::lock_guard<std::mutex> lock(pool_mutex_);
+  free_instances_.push_back(instance);
+  pool_cond_.notify_one();
+}
+
+/* Reshape the input layer and wrap it in the instance's channel views
+ * only when the batch size or the geometry changes, so the capture loops
+ * don't pay for a full net reshape and a new set of channel views on
+ * every frame. */
+void Classifier::BindInputLayer(NetInstance* instance, int batch_size) {
+  Net<float>* net = instance->net.get();
+  Blob<float>* input_layer = net->input_blobs()[0];
+  if (instance->input_channels.empty() || input_layer->num() != batch_size ||
+      input_layer->channels() != num_channels_ ||
+      input_layer->height() != input_geometry_.height ||
+      input_layer->width() != input_geometry_.width) {
+    input_layer->Reshape(batch_size, num_channels_,
+                         input_geometry_.height, input_geometry_.width);
+    /* Forward dimension change to all layers. */
+    net->Reshape();
+
+    instance->input_channels.clear();
+    WrapInputLayer(net, &instance->input_channels);
+    instance->memory = PlanMemory(net, &instance->arena);
+  }
+
+  /* mutable_cpu_data() is still called for every frame: it marks the
+   * input as modified on the host so it is synced to the GPU. */
+  CHECK(reinterpret_cast<float*>(instance->input_channels.at(0).data)
+        == input_layer->mutable_cpu_data())
+    << "Input channels are not wrapping the input layer of the network.";
 }
 
 /* Wrap the input layer of the network in separate cv::Mat objects
- * (one per channel). This way we save one memcpy operation and we
- * don't need to rely on cudaMemcpy2D. The last preprocessing
- * operation will write the separate channels directly to the input
- * layer. */
-void Classifier::WrapInputLayer(std::vector<cv::Mat>* input_channels) {
-  Blob<float>* input_layer = net_->input_blobs()[0];
+ * (one per channel of each image in the batch). This way we save one
+ * memcpy operation and we don't need to rely on cudaMemcpy2D. The last
+ * preprocessing operation will write the separate channels directly to
+ * the input layer. */
+void Classifier::WrapInputLayer(Net<float>* net,
+                                std::vector<cv::Mat>* input_channels) {
+  Blob<float>* input_layer = net->input_blobs()[0];
 
   int width = input_layer->width();
   int height = input_layer->height();
   float* input_data = input_layer->mutable_cpu_data();
-  for (int i = 0; i < input_layer->channels(); ++i) {
+  for (int i = 0; i < input_layer->num() * input_layer->channels(); ++i) {
     cv::Mat channel(height, width, CV_32FC1, input_data);
     input_channels->push_back(channel);
     input_data += width * height;
@@ -187,50 +436,388 @@ void Classifier::WrapInputLayer(std::vector<cv::Mat>* input_channels) {
 }
 
 void Classifier::Preprocess(const cv::Mat& img,
-                            std::vector<cv::Mat>* input_channels) {
-  /* Convert the input image to the input image format of the network. */
-  cv::Mat sample;
-  if (img.channels() == 3 && num_channels_ == 1)
-    cv::cvtColor(img, sample, cv::COLOR_BGR2GRAY);
-  else if (img.channels() == 4 && num_channels_ == 1)
-    cv::cvtColor(img, sample, cv::COLOR_BGRA2GRAY);
-  else if (img.channels() == 4 && num_channels_ == 3)
-    cv::cvtColor(img, sample, cv::COLOR_BGRA2BGR);
-  else if (img.channels() == 1 && num_channels_ == 3)
-    cv::cvtColor(img, sample, cv::COLOR_GRAY2BGR);
-  else
-    sample = img;
-
-  cv::Mat sample_resized;
-  if (sample.size() != input_geometry_)
-    cv::resize(sample, sample_resized, input_geometry_);
-  else
-    sample_resized = sample;
-
-  cv::Mat sample_float;
-  if (num_channels_ == 3)
-    sample_resized.convertTo(sample_float, CV_32FC3);
-  else
-    sample_resized.convertTo(sample_float, CV_32FC1);
-
-  cv::Mat sample_normalized;
-  cv::subtract(sample_float, mean_, sample_normalized);
-
-  /* This operation will write the separate BGR planes directly to the
-   * input layer of the network because it is wrapped by the cv::Mat
-   * objects in input_channels. */
-  cv::split(sample_normalized, *input_channels);
-
-  CHECK(reinterpret_cast<float*>(input_channels->at(0).data)
-        == net_->input_blobs()[0]->cpu_data())
-    << "Input channels are not wrapping the input layer of the network.";
+                            const cv::Mat* input_channels) {
+  /* Convert, resize and mean-subtract the image directly into the
+   * separate planes of the input layer wrapped by input_channels. */
+  const float mean[3] = {
+    (float) mean_[0], (float) mean_[1], (float) mean_[2]
+  };
+  PreprocessFused(img, mean, 1.0f, input_channels, num_channels_);
+}
+
+/* Print the per-layer forward profile of the network on img. */
+void Classifier::ProfileLayers(const cv::Mat& img, int iterations,
+                               std::ostream* out) {
+  NetInstance* instance = AcquireInstance();
+  BindInputLayer(instance, 1);
+  Preprocess(img, &instance->input_channels[0]);
+  ProfileNet(instance->net.get(), iterations, out);
+  ReleaseInstance(instance);
+}
+
+/* Rebuild the instance pool with the convolution and inner product layers
+ * in int8. The input range of each of them is calibrated by running the
+ * float network on calibration_files, which should look like what the
+ * engine sees in production, e.g. the frames the trainers export. The
+ * int8 instances share the float weights of net_ and one copy of the
+ * quantized weights; in CPU mode the float weights of the quantized
+ * layers are released. The engine must be idle. Return the bytes of the
+ * int8 weights, scales included, and of the float weights they
+ * replace. */
+std::pair<size_t, size_t> Classifier::EnableInt8(
+    const std::vector<string>& calibration_files) {
+  NetInstance* instance = AcquireInstance();
+  BindInputLayer(instance, 1);
+  std::vector<float> ranges;
+  int num_images = 0;
+  for (size_t i = 0; i < calibration_files.size(); ++i) {
+    cv::Mat img = cv::imread(calibration_files[i], -1);
+    if (img.empty()) {
+      LOG(WARNING) << "Unable to decode image " << calibration_files[i];
+      continue;
+    }
+    Preprocess(img, &instance->input_channels[0]);
+    RecordInputRanges(instance->net.get(), &ranges);
+    ++num_images;
+  }
+  ReleaseInstance(instance);
+  CHECK_GT(num_images, 0) << "No usable calibration image.";
+
+  NetParameter int8_param(net_param_);
+  UseInt8Layers(&int8_param);
+
+  std::lock_guard<std::mutex> lock(pool_mutex_);
+  CHECK_EQ(free_instances_.size(), instances_.size())
+    << "The engine must be idle to switch to int8.";
+  const size_t num_instances = instances_.size();
+  instances_.clear();
+  free_instances_.clear();
+  std::pair<size_t, size_t> bytes;
+  for (size_t i = 0; i < num_instances; ++i) {
+    shared_ptr<NetInstance> int8_instance(new NetInstance);
+    int8_instance->net.reset(new Net<float>(int8_param));
+    int8_instance->net->ShareTrainedLayersWith(net_.get());
+    bytes = QuantizeNet(int8_instance->net.get(), ranges,
+                        i ? instances_[0]->net.get() : NULL);
+    BindInputLayer(int8_instance.get(), 1);
+    instances_.push_back(int8_instance);
+    free_instances_.push_back(int8_instance.get());
+  }
+  ReleaseQuantizedWeights(net_.get(), *instances_[0]->net);
+
+  LOG(INFO) << "Int8 layers calibrated on " << num_images << " images, "
+            << bytes.second / 1024 << " KB of float weights replaced by "
+            << bytes.first / 1024 << " KB of int8 weights and scales.";
+#ifndef CPU_ONLY
+  LOG(WARNING) << "Int8 layers only run in CPU mode; in GPU mode they keep "
+               << "the float path.";
+#endif
+  return bytes;
+}
+
+/* Host memory of the intermediate blobs of all instances, as planned by
+ * PlanMemory and with one buffer per blob. */
+std::pair<size_t, size_t> Classifier::ActivationMemory() {
+  std::lock_guard<std::mutex> lock(pool_mutex_);
+  std::pair<size_t, size_t> total(0, 0);
+  for (size_t i = 0; i < instances_.size(); ++i) {
+    total.first += instances_[i]->memory.first;
+    total.second += instances_[i]->memory.second;
+  }
+  return total;
+}
+
+/* Compare a forward pass of an instance, with its planned memory, to
+ * one of an unplanned network, see ForwardMatchesUnplanned. */
+bool Classifier::CheckMemoryPlan() {
+  NetInstance* instance = AcquireInstance();
+  BindInputLayer(instance, 1);
+  const bool match = ForwardMatchesUnplanned(net_param_, instance->net.get());
+  ReleaseInstance(instance);
+  return match;
+}
+
+/* A decoded image waiting to be classified. */
+struct DecodedImage {
+  string path;
+  cv::Mat img;
+};
+
+/* Bounded queue between the decode threads and the classifier. Push
+ * blocks while the queue is full so that decoding never runs further
+ * ahead than queue_size images. */
+class ImageQueue {
+ public:
+  explicit ImageQueue(size_t capacity)
+    : capacity_(capacity), producers_(0) {}
+
+  void AddProducer() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++producers_;
+  }
+
+  void RemoveProducer() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    --producers_;
+    not_empty_.notify_all();
+  }
+
+  void Push(const DecodedImage& item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this] { return queue_.size() < capacity_; });
+    queue_.push_back(item);
+    not_empty_.notify_one();
+  }
+
+  /* Pop up to max_items images. Waits until a full batch is available or
+   * all producers are done; returns false once the queue is drained. */
+  bool PopBatch(size_t max_items, std::vector<DecodedImage>* items) {
+    items->clear();
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this, max_items] {
+      return queue_.size() >= max_items || producers_ == 0;
+    });
+    while (!queue_.empty() && items->size() < max_items) {
+      items->push_back(queue_.front());
+      queue_.pop_front();
+    }
+    not_full_.notify_all();
+    return !items->empty();
+  }
+
+ private:
+  size_t capacity_;
+  int producers_;
+  std::deque<DecodedImage> queue_;
+  std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+};
+
+/* Buffered writer for per-image results in CSV or JSON-lines format. */
+class ResultWriter {
+ public:
+  ResultWriter(const string& filename, const string& format)
+    : json_(format == "jsonl"), buffer_(1 << 20) {
+    CHECK(format == "csv" || format == "jsonl")
+      << "Unknown result format " << format;
+    if (!filename.empty()) {
+      file_.rdbuf()->pubsetbuf(&buffer_[0], buffer_.size());
+      file_.open(filename.c_str());
+      CHECK(file_) << "Unable to open result file " << filename;
+    }
+    out_ = filename.empty() ? &std::cout : &file_;
+  }
+
+  void Write(const string& path, const std::vector<Prediction>& predictions) {
+    std::ostream& out = *out_;
+    out << std::fixed << std::setprecision(4);
+    if (json_) {
+      out << "{\"image\":" << JsonQuote(path) << ",\"predictions\":[";
+      for (size_t i = 0; i < predictions.size(); ++i) {
+        out << (i ? "," : "") << "{\"label\":"
+            << JsonQuote(predictions[i].first)
+            << ",\"score\":" << predictions[i].second << "}";
+      }
+      out << "]}\n";
+    } else {
+      out << CsvQuote(path);
+      for (size_t i = 0; i < predictions.size(); ++i)
+        out << "," << CsvQuote(predictions[i].first)
+            << "," << predictions[i].second;
+      out << "\n";
+    }
+  }
+
+  void Flush() { out_->flush(); }
+
+ private:
+  static string CsvQuote(const string& s) {
+    string quoted = "\"";
+    for (size_t i = 0; i < s.size(); ++i) {
+      if (s[i] == '"')
+        quoted += '"';
+      quoted += s[i];
+    }
+    return quoted + "\"";
+  }
+
+  static string JsonQuote(const string& s) {
+    string quoted = "\"";
+    for (size_t i = 0; i < s.size(); ++i) {
+      unsigned char c = s[i];
+      if (c < 0x20) {
+        char escaped[8];
+        snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        quoted += escaped;
+        continue;
+      }
+      if (c == '"' || c == '\\')
+        quoted += '\\';
+      quoted += s[i];
+    }
+    return quoted + "\"";
+  }
+
+  bool json_;
+  std::vector<char> buffer_;
+  std::ofstream file_;
+  std::ostream* out_;
+};
+
+/* Classify every image of files. Decode threads feed a bounded queue and
+ * the classifier consumes it in batches, so throughput is bounded by the
+ * forward pass rather than by image decoding. */
+static void ClassifyFiles(Classifier* classifier,
+                          const std::vector<string>& files) {
+  ResultWriter writer(FLAGS_output, FLAGS_format);
+  ImageQueue queue(std::max(FLAGS_queue_size, FLAGS_batch_size));
+  std::atomic<size_t> next_file(0);
+
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+
+  std::vector<std::thread> decoders;
+  for (int t = 0; t < std::max(FLAGS_decode_threads, 1); ++t) {
+    queue.AddProducer();
+    decoders.push_back(std::thread([&] {
+      size_t i;
+      while ((i = next_file++) < files.size()) {
+        DecodedImage item;
+        item.path = files[i];
+        {
+          ScopedLatency probe(classifier->latency(), kDecode);
+          item.img = cv::imread(item.path, -1);
+        }
+        if (item.img.empty()) {
+          LOG(WARNING) << "Unable to decode image " << item.path;
+          continue;
+        }
+        queue.Push(item);
+      }
+      queue.RemoveProducer();
+    }));
+  }
+
+  /* Each inference thread runs its batches on its own instance of the
+   * classifier's network pool. */
+  std::atomic<size_t> num_classified(0);
+  std::mutex writer_mutex;
+  std::vector<std::thread> consumers;
+  for (int t = 0; t < std::max(FLAGS_inference_threads, 1); ++t) {
+    consumers.push_back(std::thread([&] {
+      std::vector<DecodedImage> batch;
+      std::vector<cv::Mat> imgs;
+      while (queue.PopBatch(std::max(FLAGS_batch_size, 1), &batch)) {
+        imgs.clear();
+        for (size_t i = 0; i < batch.size(); ++i)
+          imgs.push_back(batch[i].img);
+
+        std::vector<std::vector<Prediction> > predictions =
+          classifier->ClassifyBatch(imgs, FLAGS_top_k);
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        for (size_t i = 0; i < batch.size(); ++i)
+          writer.Write(batch[i].path, predictions[i]);
+        num_classified += batch.size();
+      }
+    }));
+  }
+
+  for (size_t t = 0; t < decoders.size(); ++t)
+    decoders[t].join();
+  for (size_t t = 0; t < consumers.size(); ++t)
+    consumers[t].join();
+  writer.Flush();
+
+  double seconds = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+  std::cerr << "Classified " << num_classified << " of " << files.size()
+            << " images in " << std::fixed << std::setprecision(2)
+            << seconds << " s (" << num_classified.load() / seconds
+            << " images/s)" << std::endl;
+  classifier->latency()->Dump(&std::cerr);
+}
+
+/* Classify images one at a time and return the elapsed seconds, after one
+ * untimed warm-up pass. */
+static double TimeClassify(Classifier* classifier,
+                           const std::vector<cv::Mat>& images,
+                           std::vector<std::vector<Prediction> >* predictions) {
+  classifier->Classify(images[0], FLAGS_top_k);
+  predictions->clear();
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+  for (size_t i = 0; i < images.size(); ++i)
+    predictions->push_back(classifier->Classify(images[i], FLAGS_top_k));
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+/* Run images through the float path, switch the classifier to int8 and
+ * run them again, then report the single-thread throughput of both paths,
+ * the weight memory of the quantized layers and how closely the int8
+ * predictions follow the float ones. */
+static void Int8Report(Classifier* classifier,
+                       const std::vector<string>& calibration_files,
+                       const std::vector<cv::Mat>& images,
+                       std::ostream* out) {
+  CHECK(!images.empty()) << "No images to compare on.";
+  std::vector<std::vector<Prediction> > float_predictions;
+  std::vector<std::vector<Prediction> > int8_predictions;
+  const double float_seconds =
+    TimeClassify(classifier, images, &float_predictions);
+  const std::pair<size_t, size_t> bytes =
+    classifier->EnableInt8(calibration_files);
+  const double int8_seconds =
+    TimeClassify(classifier, images, &int8_predictions);
+
+  int top1 = 0;
+  double overlap = 0;
+  double score_delta = 0;
+  for (size_t i = 0; i < images.size(); ++i) {
+    const std::vector<Prediction>& f = float_predictions[i];
+    const std::vector<Prediction>& q = int8_predictions[i];
+    if (f[0].first == q[0].first)
+      ++top1;
+    score_delta += std::fabs(f[0].second - q[0].second);
+    int common = 0;
+    for (size_t j = 0; j < f.size(); ++j)
+      for (size_t k = 0; k < q.size(); ++k)
+        if (f[j].first == q[k].first)
+          ++common;
+    overlap += (double) common / f.size();
+  }
+
+  const double n = images.size();
+  *out << std::fixed << std::setprecision(2)
+       << "path   images/s  ms/image  conv+ip KB\n"
+       << "float  " << std::setw(8) << n / float_seconds
+       << "  " << std::setw(8) << 1000 * float_seconds / n
+       << "  " << std::setw(10) << bytes.second / 1024 << "\n"
+       << "int8   " << std::setw(8) << n / int8_seconds
+       << "  " << std::setw(8) << 1000 * int8_seconds / n
+       << "  " << std::setw(10) << bytes.first / 1024 << "\n"
+       << "speedup " << float_seconds / int8_seconds << "x on "
+       << images.size() << " images, " << calibration_files.size()
+       << " calibration images\n"
+       << "top-1 agreement " << 100 * top1 / n << "%, top-" << FLAGS_top_k
+       << " overlap " << 100 * overlap / n << "%, mean top-1 score delta "
+       << std::setprecision(4) << score_delta / n << std::endl;
 }
 
 int main(int argc, char** argv) {
+  gflags::SetUsageMessage("Classify an image, a directory of images or a "
+        "list file of image paths.\n"
+        "Usage: classification.bin [FLAGS] deploy.prototxt "
+        "network.caffemodel mean.binaryproto labels.txt "
+        "[img.jpg | image_dir | list.txt]");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
   if (argc != 6) {
     std::cerr << "Usage: " << argv[0]
-              << " deploy.prototxt network.caffemodel"
-              << " mean.binaryproto labels.txt img.jpg" << std::endl;
+              << " [FLAGS] deploy.prototxt network.caffemodel"
+              << " mean.binaryproto labels.txt"
+              << " [img.jpg | image_dir | list.txt]" << std::endl;
     return 1;
   }
 
@@ -240,15 +827,81 @@ int main(int argc, char** argv) {
   string trained_file = argv[2];
   string mean_file    = argv[3];
   string label_file   = argv[4];
-  Classifier classifier(model_file, trained_file, mean_file, label_file);
+  Classifier classifier(model_file, trained_file, mean_file, label_file,
+                        FLAGS_bench ? BenchMaxThreads(FLAGS_bench_max_threads)
+                                    : std::max(FLAGS_inference_threads, 1));
 
   string file = argv[5];
 
+  if (FLAGS_memory_check && !classifier.CheckMemoryPlan()) {
+    std::cerr << "Memory plan check failed: the planned forward pass "
+              << "differs from the unplanned one." << std::endl;
+    return 1;
+  }
+
+  std::vector<string> calibration_files;
+  if (!FLAGS_int8_calibration.empty())
+    calibration_files = CalibrationFiles(FLAGS_int8_calibration,
+                                         FLAGS_int8_calibration_images);
+  if (FLAGS_int8_report) {
+    CHECK(!calibration_files.empty())
+      << "--int8_report needs --int8_calibration.";
+    Int8Report(&classifier, calibration_files, LoadBenchImages(file),
+               &std::cout);
+    return 0;
+  }
+  if (!calibration_files.empty())
+    classifier.EnableInt8(calibration_files);
+  if (FLAGS_memory_report) {
+    std::pair<size_t, size_t> memory = classifier.ActivationMemory();
+    std::cerr << "Intermediate blob memory: " << memory.first / 1024
+              << " KB planned, " << memory.second / 1024 << " KB naive"
+              << std::endl;
+  }
+
+  if (FLAGS_bench) {
+    BenchOptions options = { FLAGS_bench_images, FLAGS_bench_warmup,
+                             FLAGS_bench_max_batch,
+                             BenchMaxThreads(FLAGS_bench_max_threads),
+                             FLAGS_bench_output };
+    Benchmark("classify", model_file, LoadBenchImages(file),
+              [&classifier](const std::vector<cv::Mat>& batch) {
+                classifier.ClassifyBatch(batch, FLAGS_top_k);
+              },
+              options);
+    classifier.latency()->Dump(&std::cerr);
+    return 0;
+  }
+
+  /* A directory or a list file is classified in streaming mode. */
+  struct stat st;
+  CHECK_EQ(stat(file.c_str(), &st), 0) << "Unable to stat " << file;
+  if (S_ISDIR(st.st_mode)) {
+    ClassifyFiles(&classifier, ListDirectory(file));
+    return 0;
+  }
+
+  /* Anything that doesn't decode as an image is read as a list file, so
+   * that images with an unusual extension are still classified alone. */
+  cv::Mat img;
+  {
+    ScopedLatency probe(classifier.latency(), kDecode);
+    img = cv::imread(file, -1);
+  }
+  if (img.empty()) {
+    CHECK(!HasImageExtension(file)) << "Unable to decode image " << file;
+    ClassifyFiles(&classifier, ReadFileList(file));
+    return 0;
+  }
+
   std::cout << "---------- Prediction for "
             << file << " ----------" << std::endl;
 
-  cv::Mat img = cv::imread(file, -1);
-  CHECK(!img.empty()) << "Unable to decode image " << file;
+  if (FLAGS_profile > 0) {
+    classifier.ProfileLayers(img, FLAGS_profile, &std::cout);
+    return 0;
+  }
+
   std::vector<Prediction> predictions = classifier.Classify(img);
 
   /* Print the top N predictions. */
@@ -257,6 +910,7 @@ int main(int argc, char** argv) {
     std::cout << std::fixed << std::setprecision(4) << p.second << " - \""
               << p.first << "\"" << std::endl;
   }
+  classifier.latency()->Dump(&std::cerr);
 }
 #else
 int main(int argc, char** argv) {
@@ -4,61 +4,172 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #endif  // USE_OPENCV
+#include <sys/stat.h>
+#include <unistd.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
 #include <iosfwd>
+#include <iostream>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
+#include "common/frame_source.h"
+#include "common/frame_writer.h"
+#include "common/image_files.h"
+#include "common/int8_layers.h"
+#include "common/latency.h"
+#include "common/memory_plan.h"
+#include "common/preprocess.h"
+#include "common/weight_cache.h"
+
 #ifdef USE_OPENCV
 using namespace caffe;  // NOLINT(build/namespaces)
 using namespace cv;
 using std::string;
 
+DEFINE_int32(queue_depth, 2,
+    "Number of frames buffered between the capture, inference and render "
+    "stages.");
+DEFINE_bool(drop_oldest, true,
+    "Drop the oldest buffered frame when a stage falls behind, instead of "
+    "stalling the stage in front of it.");
+DEFINE_string(source, "VIDEO",
+    "Frame source: VIDEO for the camera, a video file or a .frames file.");
+DEFINE_string(record, "",
+    "Record the frames read to this .frames file for later replay.");
+DEFINE_bool(record_raw, false,
+    "Record raw pixels instead of JPEG-compressed frames.");
+DEFINE_bool(realtime_replay, true,
+    "Replay a .frames file at its recorded pace instead of as fast as "
+    "possible.");
+DEFINE_int32(top_k, 5,
+    "Number of predictions per frame.");
+DEFINE_bool(headless, false,
+    "Skip all rendering and stream per-frame results to --output.");
+DEFINE_string(output, "",
+    "Per-frame result file; standard output if empty. Results are "
+    "streamed in headless mode or whenever a file is given.");
+DEFINE_string(format, "jsonl",
+    "Per-frame result format: jsonl or bin.");
+DEFINE_string(int8_calibration, "",
+    "If set, run the convolution and inner product layers in int8 on the "
+    "CPU, calibrated on the images of this directory, e.g. "
+    "./training_data/images.");
+DEFINE_int32(int8_calibration_images, 100,
+    "Maximum number of calibration images, spread over the directory.");
+DEFINE_bool(memory_report, false,
+    "Print the host memory of the intermediate blobs, planned and with one "
+    "buffer per blob, after setup.");
+DEFINE_bool(memory_check, false,
+    "Check after setup that a forward pass with the planned intermediate "
+    "memory is bit identical to one without, and exit with an error if "
+    "not.");
+
 /* Pair (label, confidence) representing a prediction. */
 typedef std::pair<string, float> Prediction;
 
+/* The Caffe mode is thread-local, so every thread that runs a forward
+ * pass has to set it. */
+static void SetCaffeMode() {
+#ifdef CPU_ONLY
+  Caffe::set_mode(Caffe::CPU);
+#else
+  Caffe::set_mode(Caffe::GPU);
+#endif
+}
+
+/* A network of the engine's instance pool together with the channel
+ * views bound to its input layer. */
+struct NetInstance {
+  shared_ptr<Net<float> > net;
+  std::vector<cv::Mat> input_channels;
+  PlanArena arena;  // intermediate blobs, see PlanMemory
+  std::pair<size_t, size_t> memory;  // planned and naive bytes
+};
+
 class Classifier {
  public:
   Classifier(const string& model_file,
              const string& trained_file,
              const string& mean_file,
-             const string& label_file);
+             const string& label_file,
+             int num_instances = 1);
 
   std::vector<Prediction> Classify(const cv::Mat& img, int N = 5);
 
+  std::vector<std::vector<Prediction> > ClassifyBatch(
+      const std::vector<cv::Mat>& imgs, int N = 5);
+
+
+  std::pair<size_t, size_t> EnableInt8(
+      const std::vector<string>& calibration_files);
+
+  std::pair<size_t, size_t> ActivationMemory();
+
+  bool CheckMemoryPlan();
+
+  /* Latency histograms of the engine stages. Tools record their own
+   * decode and render samples into the same stats. */
+  LatencyStats* latency() { return &latency_; }
+
  private:
   void SetMean(const string& mean_file);
 
   std::vector<float> Predict(const cv::Mat& img);
 
-  void WrapInputLayer(std::vector<cv::Mat>* input_channels);
+  std::vector<float> PredictBatch(const std::vector<cv::Mat>& imgs);
+
+  void CreateInstancePool(const NetParameter& net_param, int num_instances);
+
+  NetInstance* AcquireInstance();
+
+  void ReleaseInstance(NetInstance* instance);
+
+  void BindInputLayer(NetInstance* instance, int batch_size);
 
-  void Preprocess(const cv::Mat& img,
-                  std::vector<cv::Mat>* input_channels);
+  void WrapInputLayer(Net<float>* net, std::vector<cv::Mat>* input_channels);
+
+  void Preprocess(const cv::Mat& img, const cv::Mat* input_channels);
 
  private:
-  shared_ptr<Net<float> > net_;
+  NetParameter net_param_;
+  shared_ptr<Net<float> > net_;  // first instance, owns the trained weights
+  shared_ptr<WeightMap> weights_;  // weight cache backing net_, if any
   cv::Size input_geometry_;
   int num_channels_;
-  cv::Mat mean_;
+  std::vector<shared_ptr<NetInstance> > instances_;
+  std::vector<NetInstance*> free_instances_;
+  std::mutex pool_mutex_;
+  std::condition_variable pool_cond_;
+  cv::Scalar mean_;
   std::vector<string> labels_;
+  LatencyStats latency_;
 };
 
 Classifier::Classifier(const string& model_file,
                        const string& trained_file,
                        const string& mean_file,
-                       const string& label_file) {
-#ifdef CPU_ONLY
-  Caffe::set_mode(Caffe::CPU);
-#else
-  Caffe::set_mode(Caffe::GPU);
-#endif
+                       const string& label_file,
+                       int num_instances) {
+  SetCaffeMode();
 
   /* Load the network. */
-  net_.reset(new Net<float>(model_file, TEST));
-  net_->CopyTrainedLayersFrom(trained_file);
+  ReadNetParamsFromTextFileOrDie(model_file, &net_param_);
+  net_param_.mutable_state()->set_phase(TEST);
+  net_.reset(new Net<float>(net_param_));
+  weights_ = LoadTrainedWeights(&net_param_, &net_, trained_file);
 
   CHECK_EQ(net_->num_inputs(), 1) << "Network should have exactly one input.";
   CHECK_EQ(net_->num_outputs(), 1) << "Network should have exactly one output.";
@@ -69,6 +180,8 @@ Classifier::Classifier(const string& model_file,
     << "Input layer should have 1 or 3 channels.";
   input_geometry_ = cv::Size(input_layer->width(), input_layer->height());
 
+  CreateInstancePool(net_param_, num_instances);
+
   /* Load the binaryproto mean file. */
   SetMean(mean_file);
 
@@ -105,6 +218,7 @@ static std::vector<int> Argmax(const std::vector<float>& v, int N) {
 /* Return the top N predictions. */
 std::vector<Prediction> Classifier::Classify(const cv::Mat& img, int N) {
   std::vector<float> output = Predict(img);
+  ScopedLatency probe(&latency_, kPostprocess);
 
   N = std::min<int>(labels_.size(), N);
   std::vector<int> maxN = Argmax(output, N);
@@ -117,6 +231,34 @@ std::vector<Prediction> Classifier::Classify(const cv::Mat& img, int N) {
   return predictions;
 }
 
+/* Return the top N predictions for each image of the batch. All images
+ * go through a single forward pass of the network. */
+std::vector<std::vector<Prediction> > Classifier::ClassifyBatch(
+    const std::vector<cv::Mat>& imgs, int N) {
+  std::vector<std::vector<Prediction> > all_predictions;
+  if (imgs.empty())
+    return all_predictions;
+
+  std::vector<float> output = PredictBatch(imgs);
+  ScopedLatency probe(&latency_, kPostprocess);
+
+  N = std::min<int>(labels_.size(), N);
+  const size_t num_outputs = output.size() / imgs.size();
+  for (size_t j = 0; j < imgs.size(); ++j) {
+    std::vector<float> scores(output.begin() + j * num_outputs,
+                              output.begin() + (j + 1) * num_outputs);
+    std::vector<int> maxN = Argmax(scores, N);
+    std::vector<Prediction> predictions;
+    for (int i = 0; i < N; ++i) {
+      int idx = maxN[i];
+      predictions.push_back(std::make_pair(labels_[idx], scores[idx]));
+    }
+    all_predictions.push_back(predictions);
+  }
+
+  return all_predictions;
+}
+
 /* Load the mean file in binaryproto format. */
 void Classifier::SetMean(const string& mean_file) {
   BlobProto blob_proto;
@@ -142,45 +284,136 @@ void Classifier::SetMean(const string& mean_file) {
   cv::Mat mean;
   cv::merge(channels, mean);
 
-  /* Compute the global mean pixel value and create a mean image
-   * filled with this value. */
-  cv::Scalar channel_mean = cv::mean(mean);
-  mean_ = cv::Mat(input_geometry_, mean.type(), channel_mean);
+  /* Compute the global mean pixel value, subtracted from every
+   * input pixel during preprocessing. */
+  mean_ = cv::mean(mean);
 }
 
 std::vector<float> Classifier::Predict(const cv::Mat& img) {
-  Blob<float>* input_layer = net_->input_blobs()[0];
-  input_layer->Reshape(1, num_channels_,
-                       input_geometry_.height, input_geometry_.width);
-  /* Forward dimension change to all layers. */
-  net_->Reshape();
+  return PredictBatch(std::vector<cv::Mat>(1, img));
+}
 
-  std::vector<cv::Mat> input_channels;
-  WrapInputLayer(&input_channels);
+std::vector<float> Classifier::PredictBatch(const std::vector<cv::Mat>& imgs) {
+  NetInstance* instance = AcquireInstance();
+  const int batch_size = imgs.size();
+  BindInputLayer(instance, batch_size);
 
-  Preprocess(img, &input_channels);
+  /* Each image fills its own num_channels_ planes of the input blob. */
+  {
+    ScopedLatency probe(&latency_, kPreprocess);
+    for (int i = 0; i < batch_size; ++i)
+      Preprocess(imgs[i], &instance->input_channels[i * num_channels_]);
+  }
 
-  net_->ForwardPrefilled();
+  /* Reading the output on the host waits for the device, so the forward
+   * time covers the whole network. */
+  Blob<float>* output_layer = instance->net->output_blobs()[0];
+  {
+    ScopedLatency probe(&latency_, kForward);
+    instance->net->ForwardPrefilled();
+    output_layer->cpu_data();
+  }
 
-  /* Copy the output layer to a std::vector */
-  Blob<float>* output_layer = net_->output_blobs()[0];
+  /* Copy the output layer to a std::vector, one row of
+   * output_layer->channels() scores per image. */
   const float* begin = output_layer->cpu_data();
-  const float* end = begin + output_layer->channels();
-  return std::vector<float>(begin, end);
+  const float* end = begin + batch_size * output_layer->channels();
+  std::vector<float> output(begin, end);
+
+  ReleaseInstance(instance);
+  return output;
+}
+
+/* Create the pool of num_instances networks. The first one is net_;
+ * the others share its trained parameters through ShareTrainedLayersWith,
+ * so the weights are held in memory once. Each instance has its own
+ * activations and input binding and can run a forward pass concurrently
+ * with the others. */
+void Classifier::CreateInstancePool(const NetParameter& net_param,
+                                    int num_instances) {
+  CHECK_GE(num_instances, 1) << "Need at least one network instance.";
+  for (int i = 0; i < num_instances; ++i) {
+    shared_ptr<NetInstance> instance(new NetInstance);
+    if (i == 0) {
+      instance->net = net_;
+    } else {
+      instance->net.reset(new Net<float>(net_param));
+      instance->net->ShareTrainedLayersWith(net_.get());
+    }
+    BindInputLayer(instance.get(), 1);
+    instances_.push_back(instance);
+    free_instances_.push_back(instance.get());
+  }
+
+#ifndef CPU_ONLY
+  /* Sync the shared parameters to the GPU up front so that concurrent
+   * first forward passes don't race on the host-to-device copy. */
+  const vector<shared_ptr<Blob<float> > >& params = net_->params();
+  for (size_t i = 0; i < params.size(); ++i)
+    params[i]->gpu_data();
+#endif
+}
+
+/* Hand out a free instance of the pool, waiting until one is released
+ * if all of them are busy. */
+NetInstance* Classifier::AcquireInstance() {
+  std::unique_lock<std::mutex> lock(pool_mutex_);
+  pool_cond_.wait(lock, [this] { return !free_instances_.empty(); });
+  NetInstance* instance = free_instances_.back();
+  free_instances_.pop_back();
+  lock.unlock();
+
+  SetCaffeMode();
+  return instance;
+}
+
+void Classifier::ReleaseInstance(NetInstance* instance) {
+  std::lock_guard<std::mutex> lock(pool_mutex_);
+  free_instances_.push_back(instance);
+  pool_cond_.notify_one();
+}
+
+/* Reshape the input layer and wrap it in the instance's channel views
+ * only when the batch size or the geometry changes, so the capture loops
+ * don't pay for a full net reshape and a new set of channel views on
+ * every frame. */
+void Classifier::BindInputLayer(NetInstance* instance, int batch_size) {
+  Net<float>* net = instance->net.get();
+  Blob<float>* input_layer = net->input_blobs()[0];
+  if (instance->input_channels.empty() || input_layer->num() != batch_size ||
+      input_layer->channels() != num_channels_ ||
+      input_layer->height() != input_geometry_.height ||
+      input_layer->width() != input_geometry_.width) {
+    input_layer->Reshape(batch_size, num_channels_,
+                         input_geometry_.height, input_geometry_.width);
+    /* Forward dimension change to all layers. */
+    net->Reshape();
+
+    instance->input_channels.clear();
+    WrapInputLayer(net, &instance->input_channels);
+    instance->memory = PlanMemory(net, &instance->arena);
+  }
+
+  /* mutable_cpu_data() is still called for every frame: it marks the
+   * input as modified on the host so it is synced to the GPU. */
+  CHECK(reinterpret_cast<float*>(instance->input_channels.at(0).data)
+        == input_layer->mutable_cpu_data())
+    << "Input channels are not wrapping the input layer of the network.";
 }
 
 /* Wrap the input layer of the network in separate cv::Mat objects
- * (one per channel). This way we save one memcpy operation and we
- * don't need to rely on cudaMemcpy2D. The last preprocessing
- * operation will write the separate channels directly to the input
- * layer. */
-void Classifier::WrapInputLayer(std::vector<cv::Mat>* input_channels) {
-  Blob<float>* input_layer = net_->input_blobs()[0];
+ * (one per channel of each image in the batch). This way we save one
+ * memcpy operation and we don't need to rely on cudaMemcpy2D. The last
+ * preprocessing operation will write the separate channels directly to
+ * the input layer. */
+void Classifier::WrapInputLayer(Net<float>* net,
+                                std::vector<cv::Mat>* input_channels) {
+  Blob<float>* input_layer = net->input_blobs()[0];
 
   int width = input_layer->width();
   int height = input_layer->height();
   float* input_data = input_layer->mutable_cpu_data();
-  for (int i = 0; i < input_layer->channels(); ++i) {
+  for (int i = 0; i < input_layer->num() * input_layer->channels(); ++i) {
     cv::Mat channel(height, width, CV_32FC1, input_data);
     input_channels->push_back(channel);
     input_data += width * height;
@@ -188,45 +421,147 @@ void Classifier::WrapInputLayer(std::vector<cv::Mat>* input_channels) {
 }
 
 void Classifier::Preprocess(const cv::Mat& img,
-                            std::vector<cv::Mat>* input_channels) {
-  /* Convert the input image to the input image format of the network. */
-  cv::Mat sample;
-  if (img.channels() == 3 && num_channels_ == 1)
-    cv::cvtColor(img, sample, cv::COLOR_BGR2GRAY);
-  else if (img.channels() == 4 && num_channels_ == 1)
-    cv::cvtColor(img, sample, cv::COLOR_BGRA2GRAY);
-  else if (img.channels() == 4 && num_channels_ == 3)
-    cv::cvtColor(img, sample, cv::COLOR_BGRA2BGR);
-  else if (img.channels() == 1 && num_channels_ == 3)
-    cv::cvtColor(img, sample, cv::COLOR_GRAY2BGR);
-  else
-    sample = img;
-
-  cv::Mat sample_resized;
-  if (sample.size() != input_geometry_)
-    cv::resize(sample, sample_resized, input_geometry_);
-  else
-    sample_resized = sample;
-
-  cv::Mat sample_float;
-  if (num_channels_ == 3)
-    sample_resized.convertTo(sample_float, CV_32FC3);
-  else
-    sample_resized.convertTo(sample_float, CV_32FC1);
-
-  cv::Mat sample_normalized;
-  cv::subtract(sample_float, mean_, sample_normalized);
-
-  /* This operation will write the separate BGR planes directly to the
-   * input layer of the network because it is wrapped by the cv::Mat
-   * objects in input_channels. */
-  cv::split(sample_normalized, *input_channels);
-
-  CHECK(reinterpret_cast<float*>(input_channels->at(0).data)
-        == net_->input_blobs()[0]->cpu_data())
-    << "Input channels are not wrapping the input layer of the network.";
+                            const cv::Mat* input_channels) {
+  /* Convert, resize and mean-subtract the image directly into the
+   * separate planes of the input layer wrapped by input_channels. */
+  const float mean[3] = {
+    (float) mean_[0], (float) mean_[1], (float) mean_[2]
+  };
+  PreprocessFused(img, mean, 1.0f, input_channels, num_channels_);
+}
+
+/* Rebuild the instance pool with the convolution and inner product layers
+ * in int8. The input range of each of them is calibrated by running the
+ * float network on calibration_files, which should look like what the
+ * engine sees in production, e.g. the frames the trainers export. The
+ * int8 instances share the float weights of net_ and one copy of the
+ * quantized weights; in CPU mode the float weights of the quantized
+ * layers are released. The engine must be idle. Return the bytes of the
+ * int8 weights, scales included, and of the float weights they
+ * replace. */
+std::pair<size_t, size_t> Classifier::EnableInt8(
+    const std::vector<string>& calibration_files) {
+  NetInstance* instance = AcquireInstance();
+  BindInputLayer(instance, 1);
+  std::vector<float> ranges;
+  int num_images = 0;
+  for (size_t i = 0; i < calibration_files.size(); ++i) {
+    cv::Mat img = cv::imread(calibration_files[i], -1);
+    if (img.empty()) {
+      LOG(WARNING) << "Unable to decode image " << calibration_files[i];
+      continue;
+    }
+    Preprocess(img, &instance->input_channels[0]);
+    RecordInputRanges(instance->net.get(), &ranges);
+    ++num_images;
+  }
+  ReleaseInstance(instance);
+  CHECK_GT(num_images, 0) << "No usable calibration image.";
+
+  NetParameter int8_param(net_param_);
+  UseInt8Layers(&int8_param);
+
+  std::lock_guard<std::mutex> lock(pool_mutex_);
+  CHECK_EQ(free_instances_.size(), instances_.size())
+    << "The engine must be idle to switch to int8.";
+  const size_t num_instances = instances_.size();
+  instances_.clear();
+  free_instances_.clear();
+  std::pair<size_t, size_t> bytes;
+  for (size_t i = 0; i < num_instances; ++i) {
+    shared_ptr<NetInstance> int8_instance(new NetInstance);
+    int8_instance->net.reset(new Net<float>(int8_param));
+    int8_instance->net->ShareTrainedLayersWith(net_.get());
+    bytes = QuantizeNet(int8_instance->net.get(), ranges,
+                        i ? instances_[0]->net.get() : NULL);
+    BindInputLayer(int8_instance.get(), 1);
+    instances_.push_back(int8_instance);
+    free_instances_.push_back(int8_instance.get());
+  }
+  ReleaseQuantizedWeights(net_.get(), *instances_[0]->net);
+
+  LOG(INFO) << "Int8 layers calibrated on " << num_images << " images, "
+            << bytes.second / 1024 << " KB of float weights replaced by "
+            << bytes.first / 1024 << " KB of int8 weights and scales.";
+#ifndef CPU_ONLY
+  LOG(WARNING) << "Int8 layers only run in CPU mode; in GPU mode they keep "
+               << "the float path.";
+#endif
+  return bytes;
+}
+
+/* Host memory of the intermediate blobs of all instances, as planned by
+ * PlanMemory and with one buffer per blob. */
+std::pair<size_t, size_t> Classifier::ActivationMemory() {
+  std::lock_guard<std::mutex> lock(pool_mutex_);
+  std::pair<size_t, size_t> total(0, 0);
+  for (size_t i = 0; i < instances_.size(); ++i) {
+    total.first += instances_[i]->memory.first;
+    total.second += instances_[i]->memory.second;
+  }
+  return total;
+}
+
+/* Compare a forward pass of an instance, with its planned memory, to
+ * one of an unplanned network, see ForwardMatchesUnplanned. */
+bool Classifier::CheckMemoryPlan() {
+  NetInstance* instance = AcquireInstance();
+  BindInputLayer(instance, 1);
+  const bool match = ForwardMatchesUnplanned(net_param_, instance->net.get());
+  ReleaseInstance(instance);
+  return match;
+}
+
+/* Set by SIGINT or SIGTERM so that a headless run stops at a frame
+ * boundary and flushes its results. */
+static volatile std::sig_atomic_t interrupted = 0;
+
+static void OnInterrupt(int) {
+  interrupted = 1;
+}
+
+/* Set by SIGUSR1 to print the latency percentiles while running. */
+static volatile std::sig_atomic_t dump_latency = 0;
+
+static void OnDumpLatency(int) {
+  dump_latency = 1;
+}
+
+/* Wall-clock time in microseconds since the epoch. */
+static int64_t TimestampMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
 }
 
+/* Per-frame predictions of the classifier. The binary entry layout "PRED"
+ * is per prediction the label length (uint16), the label bytes and the
+ * confidence (float32). */
+class PredictionWriter : public FrameWriter {
+ public:
+  PredictionWriter(const string& filename, const string& format)
+    : FrameWriter(filename, format, "PRED") {}
+
+  void Write(int64_t index, int64_t timestamp_us,
+             const std::vector<Prediction>& predictions) {
+    BeginRecord(index, timestamp_us, predictions.size());
+    for (size_t i = 0; i < predictions.size(); ++i) {
+      const string& label = predictions[i].first;
+      if (binary()) {
+        Put((uint16_t) label.size());
+        PutBytes(label.data(), label.size());
+        Put(predictions[i].second);
+      } else {
+        json() << (i ? "," : ",\"predictions\":[")
+               << "{\"label\":" << JsonQuote(label)
+               << ",\"score\":" << predictions[i].second << "}";
+      }
+    }
+    if (!binary())
+      json() << (predictions.empty() ? ",\"predictions\":[]" : "]");
+    EndRecord();
+  }
+};
+
 int Display_Text( cv::Mat image, std::string text, Point org )
 {
   int lineType = 8;
@@ -237,10 +572,273 @@ int Display_Text( cv::Mat image, std::string text, Point org )
 }
 
 
+/* Bounded lock-free ring buffer after Dmitry Vyukov's MPMC queue. Each
+ * cell carries a sequence number telling producers and consumers whether
+ * it is free or filled for their lap, so both ends only contend on a
+ * single compare-and-swap. The capacity is rounded up to a power of two.
+ * Push and Pop block on a condition variable, which TryPush and TryPop
+ * only touch while a caller is blocked. */
+template <typename T>
+class RingBuffer {
+ public:
+  explicit RingBuffer(size_t capacity)
+    : enqueue_pos_(0), dequeue_pos_(0), waiters_(0), epoch_(0) {
+    size_t size = 1;
+    while (size < capacity)
+      size <<= 1;
+    mask_ = size - 1;
+    cells_.reset(new Cell[size]);
+    for (size_t i = 0; i < size; ++i)
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  /* Return false without blocking if the ring is full. */
+  bool TryPush(const T& item) {
+    Cell* cell;
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &cells_[pos & mask_];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    cell->data = item;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    Notify();
+    return true;
+  }
+
+  /* Return false without blocking if the ring is empty. */
+  bool TryPop(T* item) {
+    Cell* cell;
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &cells_[pos & mask_];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    /* Move out so the cell does not keep the frame alive. */
+    *item = std::move(cell->data);
+    cell->data = T();
+    cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+    Notify();
+    return true;
+  }
+
+  /* Push item, blocking while the ring is full. Return false without
+   * pushing once stopped() is true. */
+  template <typename Predicate>
+  bool Push(const T& item, Predicate stopped) {
+    return Wait([&] { return TryPush(item); }, stopped);
+  }
+
+  /* Pop an item, blocking while the ring is empty. Return false once
+   * stopped() is true and the ring is still empty. */
+  template <typename Predicate>
+  bool Pop(T* item, Predicate stopped) {
+    return Wait([&] { return TryPop(item); }, stopped);
+  }
+
+  /* Wake the blocked callers to look at their stop condition. */
+  void Wake() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++epoch_;
+    cond_.notify_all();
+  }
+
+ private:
+  void Notify() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters_.load(std::memory_order_relaxed) > 0)
+      Wake();
+  }
+
+  /* Retry attempt until it succeeds, sleeping between tries until the
+   * other end moves. A waiter registers before its last try, so a push or
+   * pop right after that try sees it and changes the epoch. The wait is
+   * cut to 100 ms so that stop flags set from a signal handler, which
+   * cannot call Wake, are seen as well. */
+  template <typename Attempt, typename Predicate>
+  bool Wait(Attempt attempt, Predicate stopped) {
+    for (;;) {
+      if (attempt())
+        return true;
+      /* Look at the flag before the last try so an item pushed just
+       * before the producer stopped is not lost. */
+      if (stopped())
+        return attempt();
+
+      std::unique_lock<std::mutex> lock(mutex_);
+      const uint64_t epoch = epoch_;
+      waiters_.fetch_add(1);
+      lock.unlock();
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      const bool done = attempt();
+      if (!done && !stopped()) {
+        lock.lock();
+        cond_.wait_for(lock, std::chrono::milliseconds(100),
+                       [&] { return epoch_ != epoch; });
+        lock.unlock();
+      }
+      waiters_.fetch_sub(1);
+      if (done)
+        return true;
+    }
+  }
+
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T data;
+  };
+
+  std::unique_ptr<Cell[]> cells_;
+  size_t mask_;
+  /* Keep the two ends on separate cache lines. */
+  char pad0_[64];
+  std::atomic<size_t> enqueue_pos_;
+  char pad1_[64];
+  std::atomic<size_t> dequeue_pos_;
+  char pad2_[64];
+  std::atomic<int> waiters_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  uint64_t epoch_;  // changed by every wake-up, under mutex_
+};
+
+/* A camera frame travelling through the pipeline. */
+struct Frame {
+  int64_t index;
+  int64_t timestamp_us;
+  cv::Mat image;
+  std::vector<Prediction> predictions;
+};
+
+typedef RingBuffer<Frame> FrameRing;
+
+/* State shared by the pipeline stages. A stage sets its done flag once it
+ * will not push any more frames; stop is raised by the render stage. */
+struct Pipeline {
+  explicit Pipeline(size_t depth)
+    : captured(depth), classified(depth), capture_done(false),
+      inference_done(false), stop(false), dropped(0) {}
+
+  FrameRing captured;
+  FrameRing classified;
+  std::atomic<bool> capture_done;
+  std::atomic<bool> inference_done;
+  std::atomic<bool> stop;
+  std::atomic<int> dropped;
+};
+
+/* Push a frame to the next stage. A full ring either loses its oldest
+ * frame, which keeps the end-to-end latency bounded by the ring depth, or
+ * stalls this stage until the consumer catches up. */
+static void PushFrame(Pipeline* pipeline, FrameRing* ring,
+                      const Frame& frame) {
+  if (!FLAGS_drop_oldest) {
+    ring->Push(frame, [pipeline] { return pipeline->stop.load(); });
+    return;
+  }
+  while (!ring->TryPush(frame)) {
+    if (pipeline->stop)
+      return;
+    Frame oldest;
+    if (ring->TryPop(&oldest))
+      ++pipeline->dropped;
+  }
+}
+
+/* Pop the next frame, waiting for the producer. Return false once the
+ * producer is done and the ring is drained, or the pipeline is stopped. */
+static bool PopFrame(Pipeline* pipeline, FrameRing* ring,
+                     const std::atomic<bool>& producer_done, Frame* frame) {
+  return ring->Pop(frame, [pipeline, &producer_done] {
+    return pipeline->stop || producer_done;
+  });
+}
+
+static void CaptureStage(Pipeline* pipeline, FrameSource* cap,
+                         LatencyStats* latency) {
+  for (int64_t index = 0; !pipeline->stop; ++index) {
+    Frame frame;
+    cap->WaitForFrame();
+    {
+      ScopedLatency probe(latency, kDecode);
+      *cap >> frame.image;
+    }
+    frame.index = index;
+    frame.timestamp_us = TimestampMicros();
+    if (frame.image.empty())
+      break;
+    PushFrame(pipeline, &pipeline->captured, frame);
+  }
+  pipeline->capture_done = true;
+  pipeline->captured.Wake();
+}
+
+static void InferenceStage(Pipeline* pipeline, Classifier* classifier) {
+  Frame frame;
+  while (PopFrame(pipeline, &pipeline->captured, pipeline->capture_done,
+                  &frame)) {
+    frame.predictions = classifier->Classify(frame.image, FLAGS_top_k);
+    PushFrame(pipeline, &pipeline->classified, frame);
+  }
+  pipeline->inference_done = true;
+  pipeline->classified.Wake();
+}
+
+static void RenderFrame(Frame* frame) {
+  cv::Mat classifyImg = frame->image;
+  const std::vector<Prediction>& predictions = frame->predictions;
+
+  cv::Point org1(10, 380);
+  Display_Text(classifyImg, "Deep Learning Stats:", org1);
+
+  /* Print the top N predictions. */
+  size_t maxPredictions = 2;
+  size_t numPredictions = std::min(predictions.size(), maxPredictions);
+
+  for (size_t i = 0; i < numPredictions; ++i) {
+    Prediction p = predictions[i];
+    int x = 10;
+    int y = 400 + (i * 20);
+    cv::Point org(x, y);
+    Display_Text(classifyImg, p.first, org);
+    cv::Point org2(400, y);
+    char str[20];
+    sprintf(str, "%.2f", p.second);
+    Display_Text(classifyImg, str, org2);
+  }
+
+  imshow("Classifier output", classifyImg);
+}
+
 int main(int argc, char** argv) {
+  gflags::SetUsageMessage("Classify camera or recorded frames.\n"
+        "Usage: classify_capture.bin [FLAGS] deploy.prototxt "
+        "network.caffemodel mean.binaryproto labels.txt");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
   if (argc != 5) {
     std::cerr << "Usage: " << argv[0]
-              << " deploy.prototxt network.caffemodel"
+              << " [FLAGS] deploy.prototxt network.caffemodel"
               << " mean.binaryproto labels.txt" << std::endl;
     return 1;
   }
@@ -254,49 +852,92 @@ int main(int argc, char** argv) {
 
   // set up the classifier network
   Classifier classifier(model_file, trained_file, mean_file, label_file);
+  if (FLAGS_memory_check && !classifier.CheckMemoryPlan()) {
+    std::cerr << "Memory plan check failed: the planned forward pass "
+              << "differs from the unplanned one." << std::endl;
+    return 1;
+  }
+  if (!FLAGS_int8_calibration.empty())
+    classifier.EnableInt8(CalibrationFiles(FLAGS_int8_calibration,
+                                           FLAGS_int8_calibration_images));
+  if (FLAGS_memory_report) {
+    std::pair<size_t, size_t> memory = classifier.ActivationMemory();
+    std::cerr << "Intermediate blob memory: " << memory.first / 1024
+              << " KB planned, " << memory.second / 1024 << " KB naive"
+              << std::endl;
+  }
 	
   // open capture object
-  cv::VideoCapture cap(0);
-
-  if (!cap.isOpened())
+  FrameSource cap;
+  if (!cap.Open(FLAGS_source))
 	return -1;
+  cap.set_realtime(FLAGS_realtime_replay);
+  if (!FLAGS_record.empty() &&
+      !cap.StartRecording(FLAGS_record, !FLAGS_record_raw)) {
+    std::cerr << "Unable to record to " << FLAGS_record << std::endl;
+    return -1;
+  }
 
-  	for (;;) 
+  // per-frame results are streamed in headless mode or to a given file
+  std::unique_ptr<PredictionWriter> writer;
+  if (FLAGS_headless || !FLAGS_output.empty())
+    writer.reset(new PredictionWriter(FLAGS_output, FLAGS_format));
+  if (FLAGS_headless) {
+    signal(SIGINT, OnInterrupt);
+    signal(SIGTERM, OnInterrupt);
+  }
+  signal(SIGUSR1, OnDumpLatency);
+
+  // capture and inference run on their own threads, rendering stays on
+  // the main thread for highgui
+  Pipeline pipeline(std::max(FLAGS_queue_depth, 1));
+  std::thread capture(CaptureStage, &pipeline, &cap, classifier.latency());
+  std::thread inference(InferenceStage, &pipeline, &classifier);
+
+  	while (!interrupted) 
   	{
-  		// grab an image to process
-  		cv::Mat inputImg;
-  		cap >> inputImg;
-
-  		std::vector<Prediction> predictions = classifier.Classify(inputImg);
-
-  		cv::Mat classifyImg = inputImg;
-
-		cv::Point org1(10, 380);
-		Display_Text(classifyImg,"Deep Learning Stats:",org1);
-
-		  /* Print the top N predictions. */		
-		  int maxPredictions = 2;
-		  int numPredictions = (predictions.size() > maxPredictions) ? maxPredictions 
-									     : predictions.size();
-
-		  for (size_t i = 0; i < numPredictions; ++i) {
-		    Prediction p = predictions[i];
-		    int x = 10;
-		    int y = 400 + (i * 20);
-		    cv::Point org(x, y);
-		    Display_Text(classifyImg, p.first, org);
-		    cv::Point org2(400, y);
-		    char str[20];
-		    sprintf(str,"%.2f",p.second);
-		    Display_Text(classifyImg, str, org2);
-		  }
-
-  		imshow("Classifier output",classifyImg);
-	
+		// read the flag before popping so the last frame is not missed
+		bool inference_done = pipeline.inference_done;
+		Frame frame;
+		const bool popped = FLAGS_headless
+			? pipeline.classified.Pop(&frame, [&pipeline] {
+			      return interrupted || pipeline.inference_done;
+			    })
+			: pipeline.classified.TryPop(&frame);
+		if (popped) {
+			if (writer)
+				writer->Write(frame.index, frame.timestamp_us,
+				              frame.predictions);
+			if (!FLAGS_headless) {
+				ScopedLatency probe(classifier.latency(), kRender);
+				RenderFrame(&frame);
+			}
+		} else if (inference_done || FLAGS_headless) {
+			// drained, or interrupted while waiting
+			break;
+		}
+
+		if (dump_latency) {
+			dump_latency = 0;
+			classifier.latency()->Dump(&std::cerr);
+		}
+
 		// exit on ESC key
-		if (cv::waitKey(1) == 27)
+		if (!FLAGS_headless && cv::waitKey(1) == 27)
 			break;
 	}
+
+  pipeline.stop = true;
+  pipeline.captured.Wake();
+  pipeline.classified.Wake();
+  capture.join();
+  inference.join();
+  if (writer)
+    writer->Flush();
+
+  if (pipeline.dropped > 0)
+    std::cerr << "Dropped " << pipeline.dropped << " frames" << std::endl;
+  classifier.latency()->Dump(&std::cerr);
 }
 
 #else
@@ -4,156 +4,551 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #endif  // USE_OPENCV
+#include <sys/stat.h>
+#include <unistd.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
 #include <iosfwd>
+#include <iostream>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
+#include "common/frame_source.h"
+#include "common/frame_writer.h"
+#include "common/image_files.h"
+#include "common/int8_layers.h"
+#include "common/latency.h"
+#include "common/memory_plan.h"
+#include "common/preprocess.h"
+#include "common/weight_cache.h"
+
 #ifdef USE_OPENCV
 using namespace caffe;  // NOLINT(build/namespaces)
 using namespace cv;
 using std::string;
 
+DEFINE_string(record, "",
+    "Record the frames read to this .frames file for later replay.");
+DEFINE_bool(record_raw, false,
+    "Record raw pixels instead of JPEG-compressed frames.");
+DEFINE_bool(realtime_replay, true,
+    "Replay a .frames file at its recorded pace instead of as fast as "
+    "possible.");
+DEFINE_bool(headless, false,
+    "Skip all rendering and stream per-frame results to --output.");
+DEFINE_string(output, "",
+    "Per-frame result file; standard output if empty. Results are "
+    "streamed in headless mode or whenever a file is given.");
+DEFINE_string(format, "jsonl",
+    "Per-frame result format: jsonl or bin.");
+DEFINE_int32(max_detections, 21,
+    "Maximum number of detections kept per image.");
+DEFINE_double(min_confidence, 0.0,
+    "Drop detections less confident than this.");
+DEFINE_double(nms_threshold, 0.5,
+    "Drop a detection overlapping a more confident one of the same class by "
+    "more than this intersection over union.");
+DEFINE_string(int8_calibration, "",
+    "If set, run the convolution and inner product layers in int8 on the "
+    "CPU, calibrated on the images of this directory, e.g. "
+    "./training_data/images.");
+DEFINE_int32(int8_calibration_images, 100,
+    "Maximum number of calibration images, spread over the directory.");
+DEFINE_bool(memory_report, false,
+    "Print the host memory of the intermediate blobs, planned and with one "
+    "buffer per blob, after setup.");
+DEFINE_bool(memory_check, false,
+    "Check after setup that a forward pass with the planned intermediate "
+    "memory is bit identical to one without, and exit with an error if "
+    "not.");
+
+/* The Caffe mode is thread-local, so every thread that runs a forward
+ * pass has to set it. */
+static void SetCaffeMode() {
+#ifdef CPU_ONLY
+  Caffe::set_mode(Caffe::CPU);
+#else
+  Caffe::set_mode(Caffe::GPU);
+#endif
+}
+
+/* Maximum number of boxes per class in the clustered detection list. */
+static const int kMaxBoxes = 50;
+
+/* Settings of the DetectNet clustering stage, taken from the param_str
+ * of the DIGITS Python layer: image_size_x, image_size_y, stride,
+ * gridbox_cvg_threshold, gridbox_rect_thresh, gridbox_rect_eps,
+ * min_height and optionally num_classes. */
+struct ClusterParams {
+  bool enabled;
+  string coverage_blob;
+  string bboxes_blob;
+  int image_size_x;
+  int image_size_y;
+  int stride;
+  float cvg_threshold;
+  int rect_thresh;
+  float rect_eps;
+  int min_height;
+  int num_classes;
+
+  ClusterParams() : enabled(false) {}
+};
+
+/* A detected object, with its box in the pixel space of the input image. */
+struct Detection {
+  cv::Rect rect;
+  float confidence;
+  int class_id;
+};
+
+static bool CompareConfidence(const Detection& a, const Detection& b) {
+  return a.confidence > b.confidence;
+}
+
+/* Intersection over union of two boxes. */
+static float Overlap(const cv::Rect& a, const cv::Rect& b) {
+  const float intersection = (a & b).area();
+  if (intersection <= 0)
+    return 0.f;
+  return intersection / (a.area() + b.area() - intersection);
+}
+
+/* Greedy non-maximum suppression. Boxes are visited in order of
+ * decreasing confidence and kept unless they overlap a kept box of the
+ * same class by more than threshold. Kept boxes are compacted to the
+ * front of detections, which stops growing at N entries. */
+static void NonMaxSuppression(std::vector<Detection>* detections,
+                              float threshold, int N) {
+  std::vector<Detection>& d = *detections;
+  std::sort(d.begin(), d.end(), CompareConfidence);
+
+  size_t num_kept = 0;
+  for (size_t i = 0; i < d.size() && num_kept < (size_t) N; ++i) {
+    bool suppressed = false;
+    for (size_t k = 0; k < num_kept && !suppressed; ++k) {
+      suppressed = d[k].class_id == d[i].class_id &&
+                   Overlap(d[k].rect, d[i].rect) > threshold;
+    }
+    if (!suppressed)
+      d[num_kept++] = d[i];
+  }
+  d.resize(num_kept);
+}
+
+/* A network of the engine's instance pool together with the channel
+ * views bound to its input layer. */
+struct NetInstance {
+  shared_ptr<Net<float> > net;
+  std::vector<cv::Mat> input_channels;
+  PlanArena arena;  // intermediate blobs, see PlanMemory
+  std::pair<size_t, size_t> memory;  // planned and naive bytes
+};
+
 class DetectNet {
  public:
   DetectNet(const string& model_file,
-             const string& trained_file);
+            const string& trained_file,
+            int num_instances = 1);
+
+  void CreateDetections(const cv::Mat& img,
+                        std::vector<Detection>* detections,
+                        int N = 5,
+                        float min_confidence = 0.f,
+                        float nms_threshold = 0.5f);
+
+
+  std::pair<size_t, size_t> EnableInt8(
+      const std::vector<string>& calibration_files);
+
+  std::pair<size_t, size_t> ActivationMemory();
 
-  std::vector<Rect> CreateDetections(const cv::Mat& img, int N = 5);
+  bool CheckMemoryPlan();
+
+  /* Latency histograms of the engine stages. Tools record their own
+   * decode and render samples into the same stats. */
+  LatencyStats* latency() { return &latency_; }
 
  private:
-  std::vector<float> DetectionProcess(const cv::Mat& img);
+  int DetectionProcess(const cv::Mat& img, std::vector<float>* output);
+
+  void ReplaceClusterLayer(NetParameter* net_param);
+
+  void ClusterDetections(Net<float>* net, std::vector<float>* output) const;
+
+  void CreateInstancePool(const NetParameter& net_param, int num_instances);
+
+  NetInstance* AcquireInstance();
+
+  void ReleaseInstance(NetInstance* instance);
+
+  void BindInputLayer(NetInstance* instance, int batch_size);
 
-  void WrapInputLayer(std::vector<cv::Mat>* input_channels);
+  void WrapInputLayer(Net<float>* net, std::vector<cv::Mat>* input_channels);
 
-  void Preprocess(const cv::Mat& img,
-                  std::vector<cv::Mat>* input_channels);
+  void Preprocess(const cv::Mat& img, const cv::Mat* input_channels);
 
  private:
-  shared_ptr<Net<float> > net_;
+  NetParameter net_param_;
+  shared_ptr<Net<float> > net_;  // first instance, owns the trained weights
+  shared_ptr<WeightMap> weights_;  // weight cache backing net_, if any
   cv::Size input_geometry_;
   int num_channels_;
+  std::vector<shared_ptr<NetInstance> > instances_;
+  std::vector<NetInstance*> free_instances_;
+  std::mutex pool_mutex_;
+  std::condition_variable pool_cond_;
+  ClusterParams cluster_;
   std::vector<string> labels_;
+  LatencyStats latency_;
 };
 
 DetectNet::DetectNet(const string& model_file,
-                       const string& trained_file) {
-#ifdef CPU_ONLY
-  Caffe::set_mode(Caffe::CPU);
-#else
-  Caffe::set_mode(Caffe::GPU);
-#endif
+                     const string& trained_file,
+                     int num_instances) {
+  SetCaffeMode();
+
+  std::cerr << "Setting up network..." << std::endl;
 
-  std::cout << "Setting up network..." << std::endl;
+  /* Load the network. The Python clustering layer of the DIGITS deploy
+   * model is replaced by the native ClusterDetections stage. */
+  ReadNetParamsFromTextFileOrDie(model_file, &net_param_);
+  net_param_.mutable_state()->set_phase(TEST);
+  ReplaceClusterLayer(&net_param_);
 
-  /* Load the network. */
-  net_.reset(new Net<float>(model_file, TEST));
-  net_->CopyTrainedLayersFrom(trained_file);
+  net_.reset(new Net<float>(net_param_));
+  weights_ = LoadTrainedWeights(&net_param_, &net_, trained_file);
 
-  std::cout << "checking inputs, outputs..." << std::endl;
+  std::cerr << "checking inputs, outputs..." << std::endl;
 
   CHECK_EQ(net_->num_inputs(), 1) << "Network should have exactly one input.";
-  CHECK_EQ(net_->num_outputs(), 1) << "Network should have exactly TBD outputs.";
+  if (cluster_.enabled) {
+    CHECK(net_->has_blob(cluster_.coverage_blob))
+      << "Unknown coverage blob " << cluster_.coverage_blob;
+    CHECK(net_->has_blob(cluster_.bboxes_blob))
+      << "Unknown bboxes blob " << cluster_.bboxes_blob;
+  } else {
+    CHECK_EQ(net_->num_outputs(), 1)
+      << "Network should have exactly one output.";
+  }
 
   Blob<float>* input_layer = net_->input_blobs()[0];
   num_channels_ = input_layer->channels();
   CHECK(num_channels_ == 3 || num_channels_ == 1)
     << "Input layer should have 1 or 3 channels.";
   input_geometry_ = cv::Size(input_layer->width(), input_layer->height());
+  CreateInstancePool(net_param_, num_instances);
    
   Blob<float>* output_layer = net_->output_blobs()[0];
 
   // report out on network stuff - Debug only
   /*
-  std::cout << "Network name = " << net_->name() << std::endl;
+  std::cerr << "Network name = " << net_->name() << std::endl;
   vector<string> layer_names = net_->layer_names();
-  std::cout << "Layers (" << layer_names.size() << ")" << std::endl;
+  std::cerr << "Layers (" << layer_names.size() << ")" << std::endl;
   for (int i=0; i<layer_names.size(); i++)
-  	std::cout << layer_names[i] << std::endl;
+  	std::cerr << layer_names[i] << std::endl;
 
   vector<string> blob_names = net_->blob_names();
-  std::cout << "Blobs (" << blob_names.size() << ")" << std::endl;
+  std::cerr << "Blobs (" << blob_names.size() << ")" << std::endl;
   for (int i=0; i<blob_names.size(); i++)
-  	std::cout << blob_names[i] << std::endl;
+  	std::cerr << blob_names[i] << std::endl;
   */
 
 }
 
-/* Return the top N detections. */
-std::vector<Rect> DetectNet::CreateDetections(const cv::Mat& img, int N) {
-  std::vector<float> output = DetectionProcess(img);
+/* Return the N most confident detections of at least min_confidence,
+ * after suppressing boxes that overlap a more confident box of the same
+ * class by more than nms_threshold (intersection over union). */
+void DetectNet::CreateDetections(const cv::Mat& img,
+                                 std::vector<Detection>* detections,
+                                 int N,
+                                 float min_confidence,
+                                 float nms_threshold) {
+  std::vector<float> output;
+  const int num_classes = DetectionProcess(img, &output);
+
+  /* The output holds, per class, a zero padded list of
+   * (left, top, right, bottom, confidence) records in network input
+   * coordinates. */
+  const int num_records = output.size() / (5 * num_classes);
+  const float x_scale = (float) img.cols / input_geometry_.width;
+  const float y_scale = (float) img.rows / input_geometry_.height;
+
+  detections->clear();
+  for (int c = 0; c < num_classes; ++c) {
+    const float* record = &output[c * num_records * 5];
+    for (int i = 0; i < num_records; ++i, record += 5) {
+      const float confidence = record[4];
+      if (confidence <= 0)
+        break;
+      if (confidence < min_confidence)
+        continue;
+
+      Detection detection;
+      detection.rect = cv::Rect(cv::Point(record[0] * x_scale,
+                                          record[1] * y_scale),
+                                cv::Point(record[2] * x_scale,
+                                          record[3] * y_scale));
+      detection.confidence = confidence;
+      detection.class_id = c;
+      detections->push_back(detection);
+    }
+  }
 
-  // debug output of detections in output layer
-  /*
-  std::cout << "output vector size = " << output.size() << std::endl;
-  for (int i=0; i<output.size(); i++)
- 	std::cout << "output[" << i << "] = " << output[i] << std::endl;
-  */
+  NonMaxSuppression(detections, nms_threshold, N);
+}
+
+/* Run the network on img and fill output with the per-class box lists.
+ * Return the number of classes in output. */
+int DetectNet::DetectionProcess(const cv::Mat& img,
+                                std::vector<float>* output) {
+  NetInstance* instance = AcquireInstance();
+  BindInputLayer(instance, 1);
 
-  // to calibrate on current image dims
-  float xResizeFactor = (float) img.cols/input_geometry_.width;
-  float yResizeFactor = (float) img.rows/input_geometry_.height;
-  //std::cout << "Image resize factors:  x = " << xResizeFactor << ", y = " << yResizeFactor << std::endl;
-
-  std::vector<Rect> detections;
-
-  int stride = 5;
-  int ctr = 0;
-  float conf = output[ctr+4];
-  while (conf > 0) {
-        float xl = output[ctr] * xResizeFactor;
-	float yt = output[ctr+1] * yResizeFactor;
-	float xr = output[ctr+2] * xResizeFactor;
-	float yb = output[ctr+3] * yResizeFactor;
-	float width = xr - xl;
-	float height = yb - yt;
-
-	cv::Rect rect(xl, yt, width, height);
-	detections.push_back(rect);
-
-	ctr += stride;
-	conf = output[ctr+4];
+  {
+    ScopedLatency probe(&latency_, kPreprocess);
+    Preprocess(img, &instance->input_channels[0]);
   }
 
-  return detections;
+  /* Reading an output on the host waits for the device, so the forward
+   * time covers the whole network. */
+  {
+    ScopedLatency probe(&latency_, kForward);
+    instance->net->ForwardPrefilled();
+    instance->net->output_blobs()[0]->cpu_data();
+  }
+
+  /* Cluster the coverage and bbox grids, or copy the bbox list output
+   * layer of a model that does its own clustering. */
+  ScopedLatency probe(&latency_, kPostprocess);
+  int num_classes = 1;
+  if (cluster_.enabled) {
+    ClusterDetections(instance->net.get(), output);
+    num_classes = cluster_.num_classes;
+  } else {
+    Blob<float>* output_layer = instance->net->output_blobs()[0];
+    const float* begin = output_layer->cpu_data();
+    const float* end = begin + output_layer->count();
+    output->assign(begin, end);
+    if (output_layer->width() == 5)
+      num_classes = output_layer->channels();
+  }
+
+  ReleaseInstance(instance);
+  return num_classes;
 }
 
-std::vector<float> DetectNet::DetectionProcess(const cv::Mat& img) {
-  Blob<float>* input_layer = net_->input_blobs()[0];
-  input_layer->Reshape(1, num_channels_,
-                       input_geometry_.height, input_geometry_.width);
-  /* Forward dimension change to all layers. */
-  net_->Reshape();
+/* Remove the DIGITS ClusterDetections Python layer from the net
+ * definition and record its settings in cluster_, so that clustering runs
+ * in C++ on the coverage and bboxes blobs it used to consume. */
+void DetectNet::ReplaceClusterLayer(NetParameter* net_param) {
+  NetParameter stripped(*net_param);
+  stripped.clear_layer();
+  for (int i = 0; i < net_param->layer_size(); ++i) {
+    const LayerParameter& layer = net_param->layer(i);
+    if (layer.type() != "Python" ||
+        layer.python_param().layer() != "ClusterDetections") {
+      stripped.add_layer()->CopyFrom(layer);
+      continue;
+    }
+
+    CHECK(!cluster_.enabled) << "Only one clustering layer is supported.";
+    CHECK_EQ(layer.bottom_size(), 2)
+      << "Clustering layer should take the coverage and bboxes blobs.";
+
+    std::vector<float> values;
+    std::stringstream param_str(layer.python_param().param_str());
+    string item;
+    while (std::getline(param_str, item, ','))
+      values.push_back(atof(item.c_str()));
+    CHECK_GE(values.size(), 7)
+      << "Unexpected clustering param_str " << layer.python_param().param_str();
+
+    cluster_.enabled = true;
+    cluster_.coverage_blob = layer.bottom(0);
+    cluster_.bboxes_blob = layer.bottom(1);
+    cluster_.image_size_x = values[0];
+    cluster_.image_size_y = values[1];
+    cluster_.stride = values[2];
+    cluster_.cvg_threshold = values[3];
+    cluster_.rect_thresh = values[4];
+    cluster_.rect_eps = values[5];
+    cluster_.min_height = values[6];
+    cluster_.num_classes = values.size() > 7 ? (int) values[7] : 1;
+  }
+  net_param->CopyFrom(stripped);
+}
 
-  std::vector<cv::Mat> input_channels;
-  WrapInputLayer(&input_channels);
+/* Native version of the DIGITS clustering layer. Grid cells whose
+ * coverage reaches the threshold propose a box from the bboxes blob,
+ * offset by the cell position; the proposals of each class are merged
+ * with cv::groupRectangles. The output has the layout of the Python
+ * layer's bbox list: kMaxBoxes records of (left, top, right, bottom,
+ * confidence) per class, zero padded, with confidence log(group size). */
+void DetectNet::ClusterDetections(Net<float>* net,
+                                  std::vector<float>* output) const {
+  const Blob<float>* coverage = net->blob_by_name(cluster_.coverage_blob).get();
+  const Blob<float>* bboxes = net->blob_by_name(cluster_.bboxes_blob).get();
+  CHECK_GE(coverage->channels(), cluster_.num_classes)
+    << "Coverage blob has fewer channels than classes.";
+  CHECK_GE(bboxes->channels(), 4) << "Bboxes blob should have 4 channels.";
+
+  const int grid_x = cluster_.image_size_x / cluster_.stride;
+  const int grid_y = cluster_.image_size_y / cluster_.stride;
+  const int cell_width = cluster_.image_size_x / grid_x;
+  const int cell_height = cluster_.image_size_y / grid_y;
+  const int rows = std::min(grid_y, coverage->height());
+  const int cols = std::min(grid_x, coverage->width());
+  const int box_plane = bboxes->height() * bboxes->width();
+  const float* box = bboxes->cpu_data();
+
+  output->assign(cluster_.num_classes * kMaxBoxes * 5, 0.f);
+  for (int c = 0; c < cluster_.num_classes; ++c) {
+    const float* cvg = coverage->cpu_data() +
+                       c * coverage->height() * coverage->width();
+
+    std::vector<cv::Rect> rects;
+    for (int y = 0; y < rows; ++y) {
+      for (int x = 0; x < cols; ++x) {
+        if (cvg[y * coverage->width() + x] < cluster_.cvg_threshold)
+          continue;
+        const int i = y * bboxes->width() + x;
+        const int mx = x * cell_width;
+        const int my = y * cell_height;
+        /* Like the Python layer, pass the corners in the width and height
+         * slots; groupRectangles averages them as they are, so the merged
+         * rectangles come back as (left, top, right, bottom) too. */
+        rects.push_back(cv::Rect(box[i] + mx,
+                                 box[box_plane + i] + my,
+                                 box[2 * box_plane + i] + mx,
+                                 box[3 * box_plane + i] + my));
+      }
+    }
+    if (rects.empty())
+      continue;
+
+    std::vector<int> weights;
+    cv::groupRectangles(rects, weights, cluster_.rect_thresh,
+                        cluster_.rect_eps);
+
+    float* out = &(*output)[c * kMaxBoxes * 5];
+    int num_boxes = 0;
+    for (size_t i = 0; i < rects.size() && num_boxes < kMaxBoxes; ++i) {
+      if (rects[i].height - rects[i].y < cluster_.min_height)
+        continue;
+      out[0] = rects[i].x;
+      out[1] = rects[i].y;
+      out[2] = rects[i].width;
+      out[3] = rects[i].height;
+      out[4] = std::log((float) weights[i]);
+      out += 5;
+      ++num_boxes;
+    }
+  }
+}
 
-  Preprocess(img, &input_channels);
+/* Create the pool of num_instances networks. The first one is net_;
+ * the others share its trained parameters through ShareTrainedLayersWith,
+ * so the weights are held in memory once. Each instance has its own
+ * activations and input binding and can run a forward pass concurrently
+ * with the others. */
+void DetectNet::CreateInstancePool(const NetParameter& net_param,
+                                   int num_instances) {
+  CHECK_GE(num_instances, 1) << "Need at least one network instance.";
+  for (int i = 0; i < num_instances; ++i) {
+    shared_ptr<NetInstance> instance(new NetInstance);
+    if (i == 0) {
+      instance->net = net_;
+    } else {
+      instance->net.reset(new Net<float>(net_param));
+      instance->net->ShareTrainedLayersWith(net_.get());
+    }
+    BindInputLayer(instance.get(), 1);
+    instances_.push_back(instance);
+    free_instances_.push_back(instance.get());
+  }
 
-  net_->ForwardPrefilled();
+#ifndef CPU_ONLY
+  /* Sync the shared parameters to the GPU up front so that concurrent
+   * first forward passes don't race on the host-to-device copy. */
+  const vector<shared_ptr<Blob<float> > >& params = net_->params();
+  for (size_t i = 0; i < params.size(); ++i)
+    params[i]->gpu_data();
+#endif
+}
 
-  /* Copy the output layer to a std::vector */
-  Blob<float>* output_layer = net_->output_blobs()[0];
-  const float* begin = output_layer->cpu_data();
-  const float* end = begin + output_layer->channels();
+/* Hand out a free instance of the pool, waiting until one is released
+ * if all of them are busy. */
+NetInstance* DetectNet::AcquireInstance() {
+  std::unique_lock<std::mutex> lock(pool_mutex_);
+  pool_cond_.wait(lock, [this] { return !free_instances_.empty(); });
+  NetInstance* instance = free_instances_.back();
+  free_instances_.pop_back();
+  lock.unlock();
+
+  SetCaffeMode();
+  return instance;
+}
+
+void DetectNet::ReleaseInstance(NetInstance* instance) {
+  std::lock_guard<std::mutex> lock(pool_mutex_);
+  free_instances_.push_back(instance);
+  pool_cond_.notify_one();
+}
 
-  return std::vector<float>(begin, end);
+/* Reshape the input layer and wrap it in the instance's channel views
+ * only when the batch size or the geometry changes, so the capture loops
+ * don't pay for a full net reshape and a new set of channel views on
+ * every frame. */
+void DetectNet::BindInputLayer(NetInstance* instance, int batch_size) {
+  Net<float>* net = instance->net.get();
+  Blob<float>* input_layer = net->input_blobs()[0];
+  if (instance->input_channels.empty() || input_layer->num() != batch_size ||
+      input_layer->channels() != num_channels_ ||
+      input_layer->height() != input_geometry_.height ||
+      input_layer->width() != input_geometry_.width) {
+    input_layer->Reshape(batch_size, num_channels_,
+                         input_geometry_.height, input_geometry_.width);
+    /* Forward dimension change to all layers. */
+    net->Reshape();
+
+    instance->input_channels.clear();
+    WrapInputLayer(net, &instance->input_channels);
+    instance->memory = PlanMemory(net, &instance->arena);
+  }
+
+  /* mutable_cpu_data() is still called for every frame: it marks the
+   * input as modified on the host so it is synced to the GPU. */
+  CHECK(reinterpret_cast<float*>(instance->input_channels.at(0).data)
+        == input_layer->mutable_cpu_data())
+    << "Input channels are not wrapping the input layer of the network.";
 }
 
 /* Wrap the input layer of the network in separate cv::Mat objects
- * (one per channel). This way we save one memcpy operation and we
- * don't need to rely on cudaMemcpy2D. The last preprocessing
- * operation will write the separate channels directly to the input
- * layer. */
-void DetectNet::WrapInputLayer(std::vector<cv::Mat>* input_channels) {
-  Blob<float>* input_layer = net_->input_blobs()[0];
+ * (one per channel of each image in the batch). This way we save one
+ * memcpy operation and we don't need to rely on cudaMemcpy2D. The last
+ * preprocessing operation will write the separate channels directly to
+ * the input layer. */
+void DetectNet::WrapInputLayer(Net<float>* net,
+                               std::vector<cv::Mat>* input_channels) {
+  Blob<float>* input_layer = net->input_blobs()[0];
 
   int width = input_layer->width();
   int height = input_layer->height();
   float* input_data = input_layer->mutable_cpu_data();
-  for (int i = 0; i < input_layer->channels(); ++i) {
+  for (int i = 0; i < input_layer->num() * input_layer->channels(); ++i) {
     cv::Mat channel(height, width, CV_32FC1, input_data);
     input_channels->push_back(channel);
     input_data += width * height;
@@ -161,42 +556,150 @@ void DetectNet::WrapInputLayer(std::vector<cv::Mat>* input_channels) {
 }
 
 void DetectNet::Preprocess(const cv::Mat& img,
-                            std::vector<cv::Mat>* input_channels) {
-  /* Convert the input image to the input image format of the network. */
-  cv::Mat sample;
-  if (img.channels() == 3 && num_channels_ == 1)
-    cv::cvtColor(img, sample, cv::COLOR_BGR2GRAY);
-  else if (img.channels() == 4 && num_channels_ == 1)
-    cv::cvtColor(img, sample, cv::COLOR_BGRA2GRAY);
-  else if (img.channels() == 4 && num_channels_ == 3)
-    cv::cvtColor(img, sample, cv::COLOR_BGRA2BGR);
-  else if (img.channels() == 1 && num_channels_ == 3)
-    cv::cvtColor(img, sample, cv::COLOR_GRAY2BGR);
-  else
-    sample = img;
-
-  cv::Mat sample_resized;
-  if (sample.size() != input_geometry_)
-    cv::resize(sample, sample_resized, input_geometry_);
-  else
-    sample_resized = sample;
-
-  cv::Mat sample_float;
-  if (num_channels_ == 3)
-    sample_resized.convertTo(sample_float, CV_32FC3);
-  else
-    sample_resized.convertTo(sample_float, CV_32FC1);
-
-  /* This operation will write the separate BGR planes directly to the
-   * input layer of the network because it is wrapped by the cv::Mat
-   * objects in input_channels. */
-  cv::split(sample_float, *input_channels);
-
-  CHECK(reinterpret_cast<float*>(input_channels->at(0).data)
-        == net_->input_blobs()[0]->cpu_data())
-    << "Input channels are not wrapping the input layer of the network.";
+                            const cv::Mat* input_channels) {
+  /* Convert and resize the image directly into the separate planes of
+   * the input layer wrapped by input_channels. */
+  const float mean[3] = { 0.f, 0.f, 0.f };
+  PreprocessFused(img, mean, 1.0f, input_channels, num_channels_);
+}
+
+/* Rebuild the instance pool with the convolution and inner product layers
+ * in int8. The input range of each of them is calibrated by running the
+ * float network on calibration_files, which should look like what the
+ * engine sees in production, e.g. the frames the trainers export. The
+ * int8 instances share the float weights of net_ and one copy of the
+ * quantized weights; in CPU mode the float weights of the quantized
+ * layers are released. The engine must be idle. Return the bytes of the
+ * int8 weights, scales included, and of the float weights they
+ * replace. */
+std::pair<size_t, size_t> DetectNet::EnableInt8(
+    const std::vector<string>& calibration_files) {
+  NetInstance* instance = AcquireInstance();
+  BindInputLayer(instance, 1);
+  std::vector<float> ranges;
+  int num_images = 0;
+  for (size_t i = 0; i < calibration_files.size(); ++i) {
+    cv::Mat img = cv::imread(calibration_files[i], -1);
+    if (img.empty()) {
+      LOG(WARNING) << "Unable to decode image " << calibration_files[i];
+      continue;
+    }
+    Preprocess(img, &instance->input_channels[0]);
+    RecordInputRanges(instance->net.get(), &ranges);
+    ++num_images;
+  }
+  ReleaseInstance(instance);
+  CHECK_GT(num_images, 0) << "No usable calibration image.";
+
+  NetParameter int8_param(net_param_);
+  UseInt8Layers(&int8_param);
+
+  std::lock_guard<std::mutex> lock(pool_mutex_);
+  CHECK_EQ(free_instances_.size(), instances_.size())
+    << "The engine must be idle to switch to int8.";
+  const size_t num_instances = instances_.size();
+  instances_.clear();
+  free_instances_.clear();
+  std::pair<size_t, size_t> bytes;
+  for (size_t i = 0; i < num_instances; ++i) {
+    shared_ptr<NetInstance> int8_instance(new NetInstance);
+    int8_instance->net.reset(new Net<float>(int8_param));
+    int8_instance->net->ShareTrainedLayersWith(net_.get());
+    bytes = QuantizeNet(int8_instance->net.get(), ranges,
+                        i ? instances_[0]->net.get() : NULL);
+    BindInputLayer(int8_instance.get(), 1);
+    instances_.push_back(int8_instance);
+    free_instances_.push_back(int8_instance.get());
+  }
+  ReleaseQuantizedWeights(net_.get(), *instances_[0]->net);
+
+  LOG(INFO) << "Int8 layers calibrated on " << num_images << " images, "
+            << bytes.second / 1024 << " KB of float weights replaced by "
+            << bytes.first / 1024 << " KB of int8 weights and scales.";
+#ifndef CPU_ONLY
+  LOG(WARNING) << "Int8 layers only run in CPU mode; in GPU mode they keep "
+               << "the float path.";
+#endif
+  return bytes;
 }
 
+/* Host memory of the intermediate blobs of all instances, as planned by
+ * PlanMemory and with one buffer per blob. */
+std::pair<size_t, size_t> DetectNet::ActivationMemory() {
+  std::lock_guard<std::mutex> lock(pool_mutex_);
+  std::pair<size_t, size_t> total(0, 0);
+  for (size_t i = 0; i < instances_.size(); ++i) {
+    total.first += instances_[i]->memory.first;
+    total.second += instances_[i]->memory.second;
+  }
+  return total;
+}
+
+/* Compare a forward pass of an instance, with its planned memory, to
+ * one of an unplanned network, see ForwardMatchesUnplanned. */
+bool DetectNet::CheckMemoryPlan() {
+  NetInstance* instance = AcquireInstance();
+  BindInputLayer(instance, 1);
+  const bool match = ForwardMatchesUnplanned(net_param_, instance->net.get());
+  ReleaseInstance(instance);
+  return match;
+}
+
+/* Set by SIGINT or SIGTERM so that a headless run stops at a frame
+ * boundary and flushes its results. */
+static volatile std::sig_atomic_t interrupted = 0;
+
+static void OnInterrupt(int) {
+  interrupted = 1;
+}
+
+/* Set by SIGUSR1 to print the latency percentiles while running. */
+static volatile std::sig_atomic_t dump_latency = 0;
+
+static void OnDumpLatency(int) {
+  dump_latency = 1;
+}
+
+/* Wall-clock time in microseconds since the epoch. */
+static int64_t TimestampMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/* Per-frame detections. The binary entry layout "DETS" is per detection
+ * the class id (int32), the confidence (float32) and the box as x, y,
+ * width and height (int32 each). */
+class DetectionWriter : public FrameWriter {
+ public:
+  DetectionWriter(const string& filename, const string& format)
+    : FrameWriter(filename, format, "DETS") {}
+
+  void Write(int64_t index, int64_t timestamp_us,
+             const std::vector<Detection>& detections) {
+    BeginRecord(index, timestamp_us, detections.size());
+    for (size_t i = 0; i < detections.size(); ++i) {
+      const Detection& d = detections[i];
+      if (binary()) {
+        Put((int32_t) d.class_id);
+        Put(d.confidence);
+        Put((int32_t) d.rect.x);
+        Put((int32_t) d.rect.y);
+        Put((int32_t) d.rect.width);
+        Put((int32_t) d.rect.height);
+      } else {
+        json() << (i ? "," : ",\"detections\":[")
+               << "{\"class\":" << d.class_id
+               << ",\"confidence\":" << d.confidence
+               << ",\"box\":[" << d.rect.x << "," << d.rect.y << ","
+               << d.rect.width << "," << d.rect.height << "]}";
+      }
+    }
+    if (!binary())
+      json() << (detections.empty() ? ",\"detections\":[]" : "]");
+    EndRecord();
+  }
+};
+
 int Display_Text( cv::Mat image, std::string text, Point org )
 {
   int lineType = 8;
@@ -208,10 +711,15 @@ int Display_Text( cv::Mat image, std::string text, Point org )
 
 
 int main(int argc, char** argv) {
+  gflags::SetUsageMessage("Detect objects in a video file or camera stream.\n"
+        "Usage: detectnet_capture.bin [FLAGS] deploy.prototxt "
+        "network.caffemodel [filename | file.frames | VIDEO]");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
   if (argc != 4) {
     std::cerr << "Usage: " << argv[0]
-              << " deploy.prototxt network.caffemodel"
-              << " [filename | VIDEO]" << std::endl;
+              << " [FLAGS] deploy.prototxt network.caffemodel"
+              << " [filename | file.frames | VIDEO]" << std::endl;
     return 1;
   }
 
@@ -221,45 +729,93 @@ int main(int argc, char** argv) {
   string trained_file = argv[2];
   string videoFilename = argv[3];
 
-  cv::VideoCapture vidCap;
-  std::cout << "videoFilename = " << videoFilename << std::endl;
-  if (videoFilename == "VIDEO")
-	vidCap = VideoCapture(0);
-  else
-	vidCap = VideoCapture(videoFilename);
-
-  //VideoCapture vidCap(videoFilename);
-  if (!vidCap.isOpened()) 
+  FrameSource vidCap;
+  std::cerr << "videoFilename = " << videoFilename << std::endl;
+  if (!vidCap.Open(videoFilename))
 	return -1;
+  vidCap.set_realtime(FLAGS_realtime_replay);
+  if (!FLAGS_record.empty() &&
+      !vidCap.StartRecording(FLAGS_record, !FLAGS_record_raw)) {
+    std::cerr << "Unable to record to " << FLAGS_record << std::endl;
+    return -1;
+  }
 
   // set up the detection network
   DetectNet detectNet(model_file, trained_file);
+  if (FLAGS_memory_check && !detectNet.CheckMemoryPlan()) {
+    std::cerr << "Memory plan check failed: the planned forward pass "
+              << "differs from the unplanned one." << std::endl;
+    return 1;
+  }
+  if (!FLAGS_int8_calibration.empty())
+    detectNet.EnableInt8(CalibrationFiles(FLAGS_int8_calibration,
+                                          FLAGS_int8_calibration_images));
+  if (FLAGS_memory_report) {
+    std::pair<size_t, size_t> memory = detectNet.ActivationMemory();
+    std::cerr << "Intermediate blob memory: " << memory.first / 1024
+              << " KB planned, " << memory.second / 1024 << " KB naive"
+              << std::endl;
+  }
+  std::vector<Detection> detections;
+
+  // per-frame results are streamed in headless mode or to a given file
+  std::unique_ptr<DetectionWriter> writer;
+  if (FLAGS_headless || !FLAGS_output.empty())
+    writer.reset(new DetectionWriter(FLAGS_output, FLAGS_format));
+  if (FLAGS_headless) {
+    signal(SIGINT, OnInterrupt);
+    signal(SIGTERM, OnInterrupt);
+  }
+  signal(SIGUSR1, OnDumpLatency);
 	
-  	for (;;) 
+  	for (int64_t frameIndex = 0; !interrupted; ++frameIndex) 
   	{
   		// grab an image to process
   		cv::Mat inputImg;
-  		vidCap >> inputImg;
+		vidCap.WaitForFrame();
+		{
+			ScopedLatency probe(detectNet.latency(), kDecode);
+			vidCap >> inputImg;
+		}
 		if (inputImg.empty())
-			return 0;
-
-   		cv::Mat detectedImg = inputImg;
+			break;
+		int64_t timestamp = TimestampMicros();
 
 		// get detections
-		std::vector<Rect> detections = detectNet.CreateDetections(inputImg, 21);
+		detectNet.CreateDetections(inputImg, &detections, FLAGS_max_detections,
+		                           FLAGS_min_confidence, FLAGS_nms_threshold);
+		if (writer)
+			writer->Write(frameIndex, timestamp, detections);
+		if (dump_latency) {
+			dump_latency = 0;
+			detectNet.latency()->Dump(&std::cerr);
+		}
+		if (FLAGS_headless)
+			continue;
 
-		// create and show new image with detections
-		std::cout << "\033[2J num detections = " << detections.size() << std::endl;
-		for (int i=0; i<detections.size(); i++)
 		{
-		  	cv::rectangle(detectedImg, detections[i], Scalar(0,0,255), 2, 8, 0 );
+			ScopedLatency probe(detectNet.latency(), kRender);
+   			cv::Mat detectedImg = inputImg;
+
+			// create and show new image with detections
+			for (int i=0; i<detections.size(); i++)
+			{
+			  	cv::rectangle(detectedImg, detections[i].rect, Scalar(0,0,255), 2, 8, 0 );
+			}
+			Display_Text(detectedImg,
+				"detections: " + std::to_string(detections.size()), Point(10, 20));
+			imshow("Obj Detector output", detectedImg);
 		}
-		imshow("Obj Detector output", detectedImg);
 	
 		// exit on ESC key
 		if (cv::waitKey(1) == 27)
 			break;
 	}
+
+  if (writer)
+    writer->Flush();
+  detectNet.latency()->Dump(&std::cerr);
+  return 0;
 }
 
 #else
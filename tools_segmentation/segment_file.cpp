@@ -6,18 +6,71 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #endif  // USE_OPENCV
 #include <malloc.h>
+#include <unistd.h>
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <iosfwd>
+#include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "common/bench.h"
+#include "common/image_files.h"
+#include "common/int8_layers.h"
+#include "common/latency.h"
+#include "common/memory_plan.h"
+#include "common/preprocess.h"
+#include "common/profile.h"
+#include "common/weight_cache.h"
+
 #ifdef USE_OPENCV
 using namespace caffe;  // NOLINT(build/namespaces)
 using namespace cv;
 using std::string;
 
+DEFINE_bool(bench, false,
+    "Benchmark the engine on the input image, or the images of a directory "
+    "or list file, instead of segmenting; SYNTHETIC as the image argument "
+    "selects a fixed synthetic image set.");
+DEFINE_int32(bench_images, 256,
+    "Number of images timed per benchmark configuration.");
+DEFINE_int32(bench_warmup, 4,
+    "Untimed batches per thread before each benchmark configuration.");
+DEFINE_int32(bench_max_threads, 0,
+    "Largest benchmarked thread count; the number of cores if 0.");
+DEFINE_string(bench_output, "bench_output.txt",
+    "File the benchmark results are appended to, one JSON object per "
+    "line.");
+DEFINE_int32(profile, 0,
+    "If positive, time each layer over this many forward passes on the "
+    "input image and print a per-layer table instead of segmenting.");
+DEFINE_string(int8_calibration, "",
+    "If set, run the convolution and inner product layers in int8 on the "
+    "CPU, calibrated on the images of this directory, e.g. "
+    "./training_data/images.");
+DEFINE_int32(int8_calibration_images, 100,
+    "Maximum number of calibration images, spread over the directory.");
+DEFINE_bool(memory_report, false,
+    "Print the host memory of the intermediate blobs, planned and with one "
+    "buffer per blob, after setup.");
+DEFINE_bool(memory_check, false,
+    "Check after setup that a forward pass with the planned intermediate "
+    "memory is bit identical to one without, and exit with an error if "
+    "not.");
+DEFINE_bool(int8_report, false,
+    "Compare the int8 path against the float path on the input images and "
+    "print an accuracy-vs-speed report instead of segmenting.");
+
 // Byte order:  Blue - Green - Red - Alpha
 unsigned long BGRA_color_map[21] = {
 	0x00000000,	// background
@@ -43,43 +96,100 @@ unsigned long BGRA_color_map[21] = {
 	0x80400000	// tvmonitor
 };
 
+/* The Caffe mode is thread-local, so every thread that runs a forward
+ * pass has to set it. */
+static void SetCaffeMode() {
+#ifdef CPU_ONLY
+  Caffe::set_mode(Caffe::CPU);
+#else
+  Caffe::set_mode(Caffe::GPU);
+#endif
+}
+
+/* A network of the engine's instance pool together with the channel
+ * views bound to its input layer. */
+struct NetInstance {
+  shared_ptr<Net<float> > net;
+  std::vector<cv::Mat> input_channels;
+  PlanArena arena;  // intermediate blobs, see PlanMemory
+  std::pair<size_t, size_t> memory;  // planned and naive bytes
+};
+
 class Segmenter {
  public:
   Segmenter(const string& model_file,
              const string& trained_file,
-             const string& label_file);
+             const string& label_file,
+             int num_instances = 1);
 
    cv::Mat CreateSegmentedImage(const cv::Mat& img, int N = 5);
 
+  void CreateClassMap(const cv::Mat& img, cv::Mat* class_map);
+
+  void Colorize(const cv::Mat& class_map, cv::Mat* colored) const;
+
+  void Overlay(const cv::Mat& class_map, cv::Mat* frame,
+               float alpha = 0.5f) const;
+
+  void ProfileLayers(const cv::Mat& img, int iterations,
+                     std::ostream* out);
+
+  std::pair<size_t, size_t> EnableInt8(
+      const std::vector<string>& calibration_files);
+
+  std::pair<size_t, size_t> ActivationMemory();
+
+  bool CheckMemoryPlan();
+
+  /* Latency histograms of the engine stages. Tools record their own
+   * decode and render samples into the same stats. */
+  LatencyStats* latency() { return &latency_; }
+
  private:
-  cv::Mat SegmentProcess(const cv::Mat& img);
+  void SegmentProcess(const cv::Mat& img, cv::Mat* class_map);
 
-  void WrapInputLayer(std::vector<cv::Mat>* input_channels);
+  void SetColorMap();
 
-  void Preprocess(const cv::Mat& img,
-                  std::vector<cv::Mat>* input_channels);
+  void CreateInstancePool(const NetParameter& net_param, int num_instances);
+
+  NetInstance* AcquireInstance();
+
+  void ReleaseInstance(NetInstance* instance);
+
+  void BindInputLayer(NetInstance* instance, int batch_size);
+
+  void WrapInputLayer(Net<float>* net, std::vector<cv::Mat>* input_channels);
+
+  void Preprocess(const cv::Mat& img, const cv::Mat* input_channels);
 
  private:
-  shared_ptr<Net<float> > net_;
+  NetParameter net_param_;
+  shared_ptr<Net<float> > net_;  // first instance, owns the trained weights
+  shared_ptr<WeightMap> weights_;  // weight cache backing net_, if any
   cv::Size input_geometry_;
   int num_channels_;
+  std::vector<shared_ptr<NetInstance> > instances_;
+  std::vector<NetInstance*> free_instances_;
+  std::mutex pool_mutex_;
+  std::condition_variable pool_cond_;
   std::vector<string> labels_;
+  std::vector<cv::Vec3b> color_lut_;
+  LatencyStats latency_;
 };
 
 Segmenter::Segmenter(const string& model_file,
                        const string& trained_file,
-                       const string& label_file) {
-#ifdef CPU_ONLY
-  Caffe::set_mode(Caffe::CPU);
-#else
-  Caffe::set_mode(Caffe::GPU);
-#endif
+                       const string& label_file,
+                       int num_instances) {
+  SetCaffeMode();
 
   std::cout << "Setting up network..." << std::endl;
 
   /* Load the network. */
-  net_.reset(new Net<float>(model_file, TEST));
-  net_->CopyTrainedLayersFrom(trained_file);
+  ReadNetParamsFromTextFileOrDie(model_file, &net_param_);
+  net_param_.mutable_state()->set_phase(TEST);
+  net_.reset(new Net<float>(net_param_));
+  weights_ = LoadTrainedWeights(&net_param_, &net_, trained_file);
 
   std::cout << "checking inputs, outputs..." << std::endl;
 
@@ -91,6 +201,7 @@ Segmenter::Segmenter(const string& model_file,
   CHECK(num_channels_ == 3 || num_channels_ == 1)
     << "Input layer should have 1 or 3 channels.";
   input_geometry_ = cv::Size(input_layer->width(), input_layer->height());
+  CreateInstancePool(net_param_, num_instances);
    
   /* Load labels. */
   std::ifstream labels(label_file.c_str());
@@ -102,6 +213,8 @@ Segmenter::Segmenter(const string& model_file,
     labels_.push_back(string(line));
   }
 
+  SetColorMap();
+
   Blob<float>* output_layer = net_->output_blobs()[0];
   //CHECK_EQ(labels_.size(), output_layer->channels())
   //  << "Number of labels is different from the output layer dimension.";
@@ -126,103 +239,283 @@ Segmenter::Segmenter(const string& model_file,
  
 }
 
-/* Return the indices of the top value in list. */
-static int ArgMax(const float *values[], int ptr_increment, int size) {
-	
-	float maxVal = 0;
-	int maxIndex = 0;   // by default return background
+/* Per-pixel argmax over the class score planes of the output layer.
+ * Instead of walking all class planes for every pixel, each class plane
+ * is swept contiguously over a chunk of pixels while a running max and
+ * argmax are kept for the chunk, so the inner loop is a branch-free
+ * select the compiler can vectorize. Rows are split across OpenCV's
+ * thread pool. As before, a pixel stays background (class 0) unless
+ * some class scores above zero. */
+class ArgMaxInvoker : public cv::ParallelLoopBody {
+ public:
+  ArgMaxInvoker(const float* scores, int num_classes,
+                int height, int width, uchar* labels)
+    : scores_(scores), num_classes_(num_classes),
+      height_(height), width_(width), labels_(labels) {}
+
+  virtual void operator()(const cv::Range& rows) const {
+    const int kChunk = 4096;
+    const int image_size = height_ * width_;
+    const int end = rows.end * width_;
+    float max_score[kChunk];
+
+    for (int begin = rows.start * width_; begin < end; begin += kChunk) {
+      const int count = std::min(kChunk, end - begin);
+      uchar* label = labels_ + begin;
+
+      const float* plane = scores_ + begin;
+      for (int i = 0; i < count; ++i) {
+        max_score[i] = std::max(plane[i], 0.f);
+        label[i] = 0;
+      }
+
+      for (int c = 1; c < num_classes_; ++c) {
+        plane = scores_ + c * image_size + begin;
+        const uchar index = c;
+        for (int i = 0; i < count; ++i) {
+          const bool greater = plane[i] > max_score[i];
+          max_score[i] = greater ? plane[i] : max_score[i];
+          label[i] = greater ? index : label[i];
+        }
+      }
+    }
+  }
 
-	for (int i=0; i < size; i++) {
-		if (*(values[i]+ptr_increment) > maxVal) {
-			maxVal = *(values[i]+ptr_increment);
-			maxIndex = i;
-		}
-	}
+ private:
+  const float* scores_;
+  int num_classes_;
+  int height_;
+  int width_;
+  uchar* labels_;
+};
 
-	return maxIndex;
-}
+/* Upsample a class map to the size of a BGR(A) frame with nearest
+ * neighbour sampling and blend its class colors into the frame in place.
+ * This replaces a full-size resize of the colored map followed by
+ * cv::addWeighted with one pass over the frame, split across OpenCV's
+ * thread pool by rows. */
+class OverlayInvoker : public cv::ParallelLoopBody {
+ public:
+  OverlayInvoker(const cv::Mat& class_map, const cv::Vec3b* color_lut,
+                 int weight, const std::vector<int>& xofs, cv::Mat* frame)
+    : class_map_(class_map), color_lut_(color_lut), weight_(weight),
+      xofs_(xofs), frame_(frame) {}
+
+  virtual void operator()(const cv::Range& rows) const {
+    const int channels = frame_->channels();
+    const int inv_weight = 256 - weight_;
+    for (int y = rows.start; y < rows.end; ++y) {
+      const int sy = std::min(y * class_map_.rows / frame_->rows,
+                              class_map_.rows - 1);
+      const uchar* label = class_map_.ptr<uchar>(sy);
+      uchar* pixel = frame_->ptr<uchar>(y);
+      for (int x = 0; x < frame_->cols; ++x, pixel += channels) {
+        const cv::Vec3b& color = color_lut_[label[xofs_[x]]];
+        pixel[0] = (pixel[0] * inv_weight + color[0] * weight_ + 128) >> 8;
+        pixel[1] = (pixel[1] * inv_weight + color[1] * weight_ + 128) >> 8;
+        pixel[2] = (pixel[2] * inv_weight + color[2] * weight_ + 128) >> 8;
+      }
+    }
+  }
+
+ private:
+  const cv::Mat& class_map_;
+  const cv::Vec3b* color_lut_;
+  int weight_;
+  const std::vector<int>& xofs_;
+  cv::Mat* frame_;
+};
 
-/* Return the segmented image. */
+/* Return the segmented image, colorized with the class color map. */
 cv::Mat Segmenter::CreateSegmentedImage(const cv::Mat& img, int N) {
-  cv::Mat output = SegmentProcess(img);
+  cv::Mat class_map;
+  CreateClassMap(img, &class_map);
 
+  cv::Mat output;
+  Colorize(class_map, &output);
   return output;
 }
 
-cv::Mat Segmenter::SegmentProcess(const cv::Mat& img) {
-  Blob<float>* input_layer = net_->input_blobs()[0];
-  input_layer->Reshape(1, num_channels_,
-                       input_geometry_.height, input_geometry_.width);
-  /* Forward dimension change to all layers. */
-  net_->Reshape();
-
-  std::vector<cv::Mat> input_channels;
-  WrapInputLayer(&input_channels);
+/* Compute the CV_8UC1 map of the most-likely class index of every output
+ * pixel. class_map is only reallocated when the output geometry changes,
+ * so a caller that keeps it across frames reuses the same buffer. */
+void Segmenter::CreateClassMap(const cv::Mat& img, cv::Mat* class_map) {
+  SegmentProcess(img, class_map);
+}
 
-  std::cout << "Preprocessing... " << std::endl;
+/* Blend the class colors of class_map into frame with weight alpha,
+ * upsampling the class map to the frame size on the fly. */
+void Segmenter::Overlay(const cv::Mat& class_map, cv::Mat* frame,
+                        float alpha) const {
+  CHECK_EQ(class_map.type(), CV_8UC1) << "Class map should be CV_8UC1.";
+  CHECK(frame->depth() == CV_8U &&
+        (frame->channels() == 3 || frame->channels() == 4))
+    << "Frame should be an 8-bit BGR or BGRA image.";
+
+  std::vector<int> xofs(frame->cols);
+  for (int x = 0; x < frame->cols; ++x)
+    xofs[x] = std::min(x * class_map.cols / frame->cols, class_map.cols - 1);
+
+  const int weight = cvRound(std::min(std::max(alpha, 0.f), 1.f) * 256);
+  cv::parallel_for_(cv::Range(0, frame->rows),
+                    OverlayInvoker(class_map, &color_lut_[0], weight,
+                                   xofs, frame));
+}
 
-  Preprocess(img, &input_channels);
+/* Build the 256-entry class to BGR color lookup table from
+ * BGRA_color_map; classes without a color map entry are black. */
+void Segmenter::SetColorMap() {
+  const int num_colors = sizeof(BGRA_color_map) / sizeof(BGRA_color_map[0]);
+  color_lut_.assign(256, cv::Vec3b());
+  for (int i = 0; i < num_colors; ++i) {
+    color_lut_[i][0] = (BGRA_color_map[i] >> 24) & 0xff;  // B
+    color_lut_[i][1] = (BGRA_color_map[i] >> 16) & 0xff;  // G
+    color_lut_[i][2] = (BGRA_color_map[i] >> 8) & 0xff;   // R
+  }
+}
 
-  std::cout << "Running network... " << std::endl;
+/* Map a class index map to a CV_8UC3 image through the color lookup
+ * table. Consumers that only need labels can skip this stage. */
+void Segmenter::Colorize(const cv::Mat& class_map, cv::Mat* colored) const {
+  CHECK_EQ(class_map.type(), CV_8UC1) << "Class map should be CV_8UC1.";
+  colored->create(class_map.rows, class_map.cols, CV_8UC3);
+  for (int y = 0; y < class_map.rows; ++y) {
+    const uchar* label = class_map.ptr<uchar>(y);
+    cv::Vec3b* color = colored->ptr<cv::Vec3b>(y);
+    for (int x = 0; x < class_map.cols; ++x)
+      color[x] = color_lut_[label[x]];
+  }
+}
 
-  net_->ForwardPrefilled();
+void Segmenter::SegmentProcess(const cv::Mat& img, cv::Mat* class_map) {
+  NetInstance* instance = AcquireInstance();
+  BindInputLayer(instance, 1);
 
-  std::cout << "Formatting output... " << std::endl;
+  {
+    ScopedLatency probe(&latency_, kPreprocess);
+    Preprocess(img, &instance->input_channels[0]);
+  }
 
-  /* Grab a reference to the output layer as an float buffer ptr */
-  Blob<float>* output_layer = net_->output_blobs()[0];
-  const float *output_buffer = output_layer->cpu_data();
+  /* Grab a reference to the output layer as an float buffer ptr. Reading
+   * it on the host waits for the device, so the forward time covers the
+   * whole network. */
+  Blob<float>* output_layer = instance->net->output_blobs()[0];
+  const float *output_buffer;
+  {
+    ScopedLatency probe(&latency_, kForward);
+    instance->net->ForwardPrefilled();
+    output_buffer = output_layer->cpu_data();
+  }
+  ScopedLatency probe(&latency_, kPostprocess);
   //std::cout << "Output Blob shape = " << output_layer->shape_string() << std::endl;
 
   // dimensions - number of classes (C), image height (H), image width (W)
   const int num_classes = output_layer->channels();
-  int image_size = output_layer->height() * output_layer->width();
- 
-  // set up the class buffer pointers into each class sub-buffer
-  const float *class_buf_ptr[num_classes];
-  for (int i=0; i<num_classes; i++) {
-	class_buf_ptr[i] = &(output_buffer[i*image_size]);
+  const int height = output_layer->height();
+  const int width = output_layer->width();
+  CHECK_LE(num_classes, 256) << "Class indices must fit in 8 bits.";
+
+  // find the index of the most-likely class for every pixel, written
+  // straight into the caller's class map
+  class_map->create(height, width, CV_8UC1);
+  CHECK(class_map->isContinuous()) << "Class map should be continuous.";
+  cv::parallel_for_(cv::Range(0, height),
+                    ArgMaxInvoker(output_buffer, num_classes, height, width,
+                                  class_map->data));
+
+  ReleaseInstance(instance);
+}
+
+/* Create the pool of num_instances networks. The first one is net_;
+ * the others share its trained parameters through ShareTrainedLayersWith,
+ * so the weights are held in memory once. Each instance has its own
+ * activations and input binding and can run a forward pass concurrently
+ * with the others. */
+void Segmenter::CreateInstancePool(const NetParameter& net_param,
+                                   int num_instances) {
+  CHECK_GE(num_instances, 1) << "Need at least one network instance.";
+  for (int i = 0; i < num_instances; ++i) {
+    shared_ptr<NetInstance> instance(new NetInstance);
+    if (i == 0) {
+      instance->net = net_;
+    } else {
+      instance->net.reset(new Net<float>(net_param));
+      instance->net->ShareTrainedLayersWith(net_.get());
+    }
+    BindInputLayer(instance.get(), 1);
+    instances_.push_back(instance);
+    free_instances_.push_back(instance.get());
   }
- 
-  /****************** creating RGBA image buffer from output layer ***************/
-  //assume three channels only
-  int num_channels = 3;
-  int fill_buffer_size = image_size * num_channels;
-  unsigned char fill_buffer[fill_buffer_size];
-  memset(fill_buffer, 0, fill_buffer_size);
-
-  // for each pixel in the image
-  for (int i=0; i<image_size; i++) {
-	
-	// find the index of most-likely class for this pixel
-	int topClassIndex = ArgMax(class_buf_ptr,i,num_classes);
-
-	// apply the colormap for that class
-	int bufIndex = i*num_channels;
-	fill_buffer[bufIndex] = (BGRA_color_map[topClassIndex] >> 24) & 0xff;      // B
-	fill_buffer[bufIndex+1] = (BGRA_color_map[topClassIndex] >> 16) & 0xff;    // G
-	fill_buffer[bufIndex+2] = (BGRA_color_map[topClassIndex] >> 8) & 0xff;     // R
-	//fill_buffer[bufIndex+3] = BGRA_color_map[topClassIndex] & 0xff;   	   // A
-     }
-
-  cv::Mat segmentedImg = cv::Mat(output_layer->height(), output_layer->width(), CV_8UC3, &fill_buffer[0], 0);
-  /****************** creating RGBA image buffer from output layer ***************/
-
-  return segmentedImg;
+
+#ifndef CPU_ONLY
+  /* Sync the shared parameters to the GPU up front so that concurrent
+   * first forward passes don't race on the host-to-device copy. */
+  const vector<shared_ptr<Blob<float> > >& params = net_->params();
+  for (size_t i = 0; i < params.size(); ++i)
+    params[i]->gpu_data();
+#endif
+}
+
+/* Hand out a free instance of the pool, waiting until one is released
+ * if all of them are busy. */
+NetInstance* Segmenter::AcquireInstance() {
+  std::unique_lock<std::mutex> lock(pool_mutex_);
+  pool_cond_.wait(lock, [this] { return !free_instances_.empty(); });
+  NetInstance* instance = free_instances_.back();
+  free_instances_.pop_back();
+  lock.unlock();
+
+  SetCaffeMode();
+  return instance;
+}
+
+void Segmenter::ReleaseInstance(NetInstance* instance) {
+  std::lock_guard<std::mutex> lock(pool_mutex_);
+  free_instances_.push_back(instance);
+  pool_cond_.notify_one();
+}
+
+/* Reshape the input layer and wrap it in the instance's channel views
+ * only when the batch size or the geometry changes, so the capture loops
+ * don't pay for a full net reshape and a new set of channel views on
+ * every frame. */
+void Segmenter::BindInputLayer(NetInstance* instance, int batch_size) {
+  Net<float>* net = instance->net.get();
+  Blob<float>* input_layer = net->input_blobs()[0];
+  if (instance->input_channels.empty() || input_layer->num() != batch_size ||
+      input_layer->channels() != num_channels_ ||
+      input_layer->height() != input_geometry_.height ||
+      input_layer->width() != input_geometry_.width) {
+    input_layer->Reshape(batch_size, num_channels_,
+                         input_geometry_.height, input_geometry_.width);
+    /* Forward dimension change to all layers. */
+    net->Reshape();
+
+    instance->input_channels.clear();
+    WrapInputLayer(net, &instance->input_channels);
+    instance->memory = PlanMemory(net, &instance->arena);
+  }
+
+  /* mutable_cpu_data() is still called for every frame: it marks the
+   * input as modified on the host so it is synced to the GPU. */
+  CHECK(reinterpret_cast<float*>(instance->input_channels.at(0).data)
+        == input_layer->mutable_cpu_data())
+    << "Input channels are not wrapping the input layer of the network.";
 }
 
 /* Wrap the input layer of the network in separate cv::Mat objects
- * (one per channel). This way we save one memcpy operation and we
- * don't need to rely on cudaMemcpy2D. The last preprocessing
- * operation will write the separate channels directly to the input
- * layer. */
-void Segmenter::WrapInputLayer(std::vector<cv::Mat>* input_channels) {
-  Blob<float>* input_layer = net_->input_blobs()[0];
+ * (one per channel of each image in the batch). This way we save one
+ * memcpy operation and we don't need to rely on cudaMemcpy2D. The last
+ * preprocessing operation will write the separate channels directly to
+ * the input layer. */
+void Segmenter::WrapInputLayer(Net<float>* net,
+                               std::vector<cv::Mat>* input_channels) {
+  Blob<float>* input_layer = net->input_blobs()[0];
 
   int width = input_layer->width();
   int height = input_layer->height();
   float* input_data = input_layer->mutable_cpu_data();
-  for (int i = 0; i < input_layer->channels(); ++i) {
+  for (int i = 0; i < input_layer->num() * input_layer->channels(); ++i) {
     cv::Mat channel(height, width, CV_32FC1, input_data);
     input_channels->push_back(channel);
     input_data += width * height;
@@ -230,40 +523,103 @@ void Segmenter::WrapInputLayer(std::vector<cv::Mat>* input_channels) {
 }
 
 void Segmenter::Preprocess(const cv::Mat& img,
-                            std::vector<cv::Mat>* input_channels) {
-  /* Convert the input image to the input image format of the network. */
-  cv::Mat sample;
-  if (img.channels() == 3 && num_channels_ == 1)
-    cv::cvtColor(img, sample, cv::COLOR_BGR2GRAY);
-  else if (img.channels() == 4 && num_channels_ == 1)
-    cv::cvtColor(img, sample, cv::COLOR_BGRA2GRAY);
-  else if (img.channels() == 4 && num_channels_ == 3)
-    cv::cvtColor(img, sample, cv::COLOR_BGRA2BGR);
-  else if (img.channels() == 1 && num_channels_ == 3)
-    cv::cvtColor(img, sample, cv::COLOR_GRAY2BGR);
-  else
-    sample = img;
-
-  cv::Mat sample_resized;
-  if (sample.size() != input_geometry_)
-    cv::resize(sample, sample_resized, input_geometry_);
-  else
-    sample_resized = sample;
-
-  cv::Mat sample_float;
-  if (num_channels_ == 3)
-    sample_resized.convertTo(sample_float, CV_32FC3);
-  else
-    sample_resized.convertTo(sample_float, CV_32FC1);
-
-  /* This operation will write the separate BGR planes directly to the
-   * input layer of the network because it is wrapped by the cv::Mat
-   * objects in input_channels. */
-  cv::split(sample_float, *input_channels);
-
-  CHECK(reinterpret_cast<float*>(input_channels->at(0).data)
-        == net_->input_blobs()[0]->cpu_data())
-    << "Input channels are not wrapping the input layer of the network.";
+                            const cv::Mat* input_channels) {
+  /* Convert and resize the image directly into the separate planes of
+   * the input layer wrapped by input_channels. */
+  const float mean[3] = { 0.f, 0.f, 0.f };
+  PreprocessFused(img, mean, 1.0f, input_channels, num_channels_);
+}
+
+/* Rebuild the instance pool with the convolution and inner product layers
+ * in int8. The input range of each of them is calibrated by running the
+ * float network on calibration_files, which should look like what the
+ * engine sees in production, e.g. the frames the trainers export. The
+ * int8 instances share the float weights of net_ and one copy of the
+ * quantized weights; in CPU mode the float weights of the quantized
+ * layers are released. The engine must be idle. Return the bytes of the
+ * int8 weights, scales included, and of the float weights they
+ * replace. */
+std::pair<size_t, size_t> Segmenter::EnableInt8(
+    const std::vector<string>& calibration_files) {
+  NetInstance* instance = AcquireInstance();
+  BindInputLayer(instance, 1);
+  std::vector<float> ranges;
+  int num_images = 0;
+  for (size_t i = 0; i < calibration_files.size(); ++i) {
+    cv::Mat img = cv::imread(calibration_files[i], -1);
+    if (img.empty()) {
+      LOG(WARNING) << "Unable to decode image " << calibration_files[i];
+      continue;
+    }
+    Preprocess(img, &instance->input_channels[0]);
+    RecordInputRanges(instance->net.get(), &ranges);
+    ++num_images;
+  }
+  ReleaseInstance(instance);
+  CHECK_GT(num_images, 0) << "No usable calibration image.";
+
+  NetParameter int8_param(net_param_);
+  UseInt8Layers(&int8_param);
+
+  std::lock_guard<std::mutex> lock(pool_mutex_);
+  CHECK_EQ(free_instances_.size(), instances_.size())
+    << "The engine must be idle to switch to int8.";
+  const size_t num_instances = instances_.size();
+  instances_.clear();
+  free_instances_.clear();
+  std::pair<size_t, size_t> bytes;
+  for (size_t i = 0; i < num_instances; ++i) {
+    shared_ptr<NetInstance> int8_instance(new NetInstance);
+    int8_instance->net.reset(new Net<float>(int8_param));
+    int8_instance->net->ShareTrainedLayersWith(net_.get());
+    bytes = QuantizeNet(int8_instance->net.get(), ranges,
+                        i ? instances_[0]->net.get() : NULL);
+    BindInputLayer(int8_instance.get(), 1);
+    instances_.push_back(int8_instance);
+    free_instances_.push_back(int8_instance.get());
+  }
+  ReleaseQuantizedWeights(net_.get(), *instances_[0]->net);
+
+  LOG(INFO) << "Int8 layers calibrated on " << num_images << " images, "
+            << bytes.second / 1024 << " KB of float weights replaced by "
+            << bytes.first / 1024 << " KB of int8 weights and scales.";
+#ifndef CPU_ONLY
+  LOG(WARNING) << "Int8 layers only run in CPU mode; in GPU mode they keep "
+               << "the float path.";
+#endif
+  return bytes;
+}
+
+/* Host memory of the intermediate blobs of all instances, as planned by
+ * PlanMemory and with one buffer per blob. */
+std::pair<size_t, size_t> Segmenter::ActivationMemory() {
+  std::lock_guard<std::mutex> lock(pool_mutex_);
+  std::pair<size_t, size_t> total(0, 0);
+  for (size_t i = 0; i < instances_.size(); ++i) {
+    total.first += instances_[i]->memory.first;
+    total.second += instances_[i]->memory.second;
+  }
+  return total;
+}
+
+/* Compare a forward pass of an instance, with its planned memory, to
+ * one of an unplanned network, see ForwardMatchesUnplanned. */
+bool Segmenter::CheckMemoryPlan() {
+  NetInstance* instance = AcquireInstance();
+  BindInputLayer(instance, 1);
+  const bool match = ForwardMatchesUnplanned(net_param_, instance->net.get());
+  ReleaseInstance(instance);
+  return match;
+}
+
+/* Print the per-layer forward profile of the network on img. */
+void Segmenter::ProfileLayers(const cv::Mat& img, int iterations,
+                              std::ostream* out) {
+  NetInstance* instance = AcquireInstance();
+  BindInputLayer(instance, 1);
+  Preprocess(img, &instance->input_channels[0]);
+  ProfileNet(instance->net.get(), iterations, out);
+  ReleaseInstance(instance);
 }
 
 int Display_Text( cv::Mat image, std::string text, Point org )
@@ -275,11 +631,72 @@ int Display_Text( cv::Mat image, std::string text, Point org )
   return 0;
 }
 
+/* Segment images one at a time and return the elapsed seconds, after one
+ * untimed warm-up pass. */
+static double TimeSegment(Segmenter* segmenter,
+                          const std::vector<cv::Mat>& images,
+                          std::vector<cv::Mat>* class_maps) {
+  cv::Mat warmup;
+  segmenter->CreateClassMap(images[0], &warmup);
+  class_maps->assign(images.size(), cv::Mat());
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+  for (size_t i = 0; i < images.size(); ++i)
+    segmenter->CreateClassMap(images[i], &(*class_maps)[i]);
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+/* Run images through the float path, switch the segmenter to int8 and run
+ * them again, then report the single-thread throughput of both paths, the
+ * weight memory of the quantized layers and the share of pixels whose
+ * class is unchanged. */
+static void Int8Report(Segmenter* segmenter,
+                       const std::vector<string>& calibration_files,
+                       const std::vector<cv::Mat>& images,
+                       std::ostream* out) {
+  CHECK(!images.empty()) << "No images to compare on.";
+  std::vector<cv::Mat> float_maps;
+  std::vector<cv::Mat> int8_maps;
+  const double float_seconds = TimeSegment(segmenter, images, &float_maps);
+  const std::pair<size_t, size_t> bytes =
+    segmenter->EnableInt8(calibration_files);
+  const double int8_seconds = TimeSegment(segmenter, images, &int8_maps);
+
+  double pixels = 0;
+  double agree = 0;
+  for (size_t i = 0; i < images.size(); ++i) {
+    cv::Mat diff;
+    cv::compare(float_maps[i], int8_maps[i], diff, cv::CMP_EQ);
+    pixels += diff.total();
+    agree += cv::countNonZero(diff);
+  }
+
+  const double n = images.size();
+  *out << std::fixed << std::setprecision(2)
+       << "path   images/s  ms/image  conv+ip KB\n"
+       << "float  " << std::setw(8) << n / float_seconds
+       << "  " << std::setw(8) << 1000 * float_seconds / n
+       << "  " << std::setw(10) << bytes.second / 1024 << "\n"
+       << "int8   " << std::setw(8) << n / int8_seconds
+       << "  " << std::setw(8) << 1000 * int8_seconds / n
+       << "  " << std::setw(10) << bytes.first / 1024 << "\n"
+       << "speedup " << float_seconds / int8_seconds << "x on "
+       << images.size() << " images, " << calibration_files.size()
+       << " calibration images\n"
+       << "pixel class agreement " << 100 * agree / pixels << "%"
+       << std::endl;
+}
 
 int main(int argc, char** argv) {
+  gflags::SetUsageMessage("Segment an image.\n"
+        "Usage: segment_file.bin [FLAGS] deploy.prototxt "
+        "network.caffemodel labels.txt img.jpg");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
   if (argc != 5) {
     std::cerr << "Usage: " << argv[0]
-              << " deploy.prototxt network.caffemodel"
+              << " [FLAGS] deploy.prototxt network.caffemodel"
               << " labels.txt img.jpg" << std::endl;
     return 1;
   }
@@ -291,27 +708,82 @@ int main(int argc, char** argv) {
   string label_file   = argv[3];
 
   // set up the detection network
-  Segmenter segmenter(model_file, trained_file, label_file);
+  Segmenter segmenter(model_file, trained_file, label_file,
+                      FLAGS_bench ? BenchMaxThreads(FLAGS_bench_max_threads) : 1);
 
   string file = argv[4];
 
-  cv::Mat inputImg = cv::imread(file, -1);
+  if (FLAGS_memory_check && !segmenter.CheckMemoryPlan()) {
+    std::cerr << "Memory plan check failed: the planned forward pass "
+              << "differs from the unplanned one." << std::endl;
+    return 1;
+  }
+
+  std::vector<string> calibration_files;
+  if (!FLAGS_int8_calibration.empty())
+    calibration_files = CalibrationFiles(FLAGS_int8_calibration,
+                                         FLAGS_int8_calibration_images);
+  if (FLAGS_int8_report) {
+    CHECK(!calibration_files.empty())
+      << "--int8_report needs --int8_calibration.";
+    Int8Report(&segmenter, calibration_files, LoadBenchImages(file),
+               &std::cout);
+    return 0;
+  }
+  if (!calibration_files.empty())
+    segmenter.EnableInt8(calibration_files);
+  if (FLAGS_memory_report) {
+    std::pair<size_t, size_t> memory = segmenter.ActivationMemory();
+    std::cerr << "Intermediate blob memory: " << memory.first / 1024
+              << " KB planned, " << memory.second / 1024 << " KB naive"
+              << std::endl;
+  }
+
+  /* The Segmenter runs one image per forward pass, so only the thread
+   * count is swept. */
+  if (FLAGS_bench) {
+    BenchOptions options = { FLAGS_bench_images, FLAGS_bench_warmup, 1,
+                             BenchMaxThreads(FLAGS_bench_max_threads),
+                             FLAGS_bench_output };
+    Benchmark("segment", model_file, LoadBenchImages(file),
+              [&segmenter](const std::vector<cv::Mat>& batch) {
+                cv::Mat class_map;
+                for (size_t i = 0; i < batch.size(); ++i)
+                  segmenter.CreateClassMap(batch[i], &class_map);
+              },
+              options);
+    segmenter.latency()->Dump(&std::cerr);
+    return 0;
+  }
+
+  cv::Mat inputImg;
+  {
+    ScopedLatency probe(segmenter.latency(), kDecode);
+    inputImg = cv::imread(file, -1);
+  }
   CHECK(!inputImg.empty()) << "Unable to decode image " << file;
 
+  if (FLAGS_profile > 0) {
+    segmenter.ProfileLayers(inputImg, FLAGS_profile, &std::cout);
+    return 0;
+  }
+
   std::cout << "Segmentation processing... " << std::endl;
 
   // get segmented image
-  cv::Size size = inputImg.size();
-  cv::Mat segmentedImg = segmenter.CreateSegmentedImage(inputImg, 21);
-  cv::resize(segmentedImg,segmentedImg,size);
+  cv::Mat classMap;
+  segmenter.CreateClassMap(inputImg, &classMap);
 
-  // combine input and segmented images
-  cv::Mat combinedImg = cv::Mat(size.height, size.width, CV_8UC4);
-  cv::addWeighted(inputImg, 0.5f, segmentedImg, 0.5f, 0.0f, combinedImg);
+  // blend segmentation colors into the input image
+  {
+    ScopedLatency probe(segmenter.latency(), kRender);
+    cv::Mat combinedImg = inputImg;
+    segmenter.Overlay(classMap, &combinedImg, 0.5f);
 
-  //imshow("Input Image", inputImg);
-  //imshow("Segmenter output", segmentedImg);
-  imshow("Combined output", combinedImg);
+    //imshow("Input Image", inputImg);
+    imshow("Combined output", combinedImg);
+  }
+  segmenter.latency()->Dump(&std::cerr);
 
   // run forever to continue showing window
   for (;;) 
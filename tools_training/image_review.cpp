@@ -9,6 +9,11 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sstream>
+
+#include "common/dataset_index.h"
+#include "common/image_cache.h"
+#include "common/lmdb_writer.h"
 
 using namespace std;
 using namespace cv;
@@ -132,38 +137,21 @@ string selectedClass;
 int imgIndex;
 string trainingLabelPath;
 string labelFileName;
-vector<string> labelFileNames;
 
 string trainingImagePath;
 string imageFileName;
-vector<string> imageFileNames;
+DatasetIndex dataset;
+LmdbWriter* lmdbWriter = NULL;
+ImageCache* imageCache = NULL;
+
+// number of images on either side of the current one to decode ahead
+const int prefetchRadius = 4;
 
 const char* winName="Crop Image";
 bool leftclicked=false;
 bool rightclicked=false;
 char imgName[15];
 
-// returns a list of files from directory
-int getdir (string dir, vector<string> &files)
-{
-    DIR *dp;
-    struct dirent *dirp;
-    if((dp  = opendir(dir.c_str())) == NULL) {
-        cout << "Error(" << errno << ") opening " << dir << endl;
-        return errno;
-    }
-
-    while ((dirp = readdir(dp)) != NULL) {
-        files.push_back(string(dirp->d_name));
-    }
-    closedir(dp);
-
-    // sort files list alphabetically
-    std::sort( files.begin(), files.end() );
-
-    return 0;
-}
-
 void showRegions(){
 	
     //int fontFace = FONT_HERSHEY_SCRIPT_SIMPLEX;
@@ -194,7 +182,7 @@ void showRegions(){
     }
 
     Point pt2(img.cols/2 - 20,img.rows - 20);
-    putText(img,imageFileNames[imgIndex],pt2,fontFace,1,cvScalar(255,255,255), 2 ,8, false);
+    putText(img,dataset.image(imgIndex),pt2,fontFace,1,cvScalar(255,255,255), 2 ,8, false);
 
     imshow(winName,img);
 
@@ -394,20 +382,19 @@ void importTrainingData(int index)
     // first, clear the regions list
     regions.clear();
 
-    string tempImageFileName = trainingImagePath + "/" + imageFileNames[index];
-    string tempLabelFileName = trainingLabelPath + "/" + labelFileNames[index];
+    string tempImageFileName = trainingImagePath + "/" + dataset.image(index);
+    string tempLabelFileName = trainingLabelPath + "/" + dataset.label(index);
 
-    cout << "imgFileName = " << imageFileNames[index] << endl;
-    cout << "labelFilename = " << labelFileNames[index] << endl;
+    cout << "imgFileName = " << dataset.image(index) << endl;
+    cout << "labelFilename = " << dataset.label(index) << endl;
     cout << "imgFilePath = " << tempImageFileName << endl;
     cout << "labelFilePath = " << tempLabelFileName << endl;
 
-    // load image from file
-    src = imread(tempImageFileName.c_str(), -1);
+    // load image and corresponding label file, usually already prefetched
+    string labels;
+    imageCache->Get(index, tempImageFileName, tempLabelFileName, &src, &labels);
 
-    // read in corresponding label file
-    ifstream inFile;
-    inFile.open(tempLabelFileName.c_str());
+    istringstream inFile(labels);
      
     while (!inFile.eof()) {
     	LabelEntry newLabel;
@@ -417,13 +404,21 @@ void importTrainingData(int index)
 	
     }
 
-    inFile.close();
+    // decode the neighbouring images in the background, nearest first
+    imageCache->CancelPrefetch();
+    for (int i = 1; i <= prefetchRadius; i++)
+    {
+	if (index + i < dataset.size() && !dataset.deleted(index + i))
+	    imageCache->Prefetch(index + i, trainingImagePath + "/" + dataset.image(index + i), trainingLabelPath + "/" + dataset.label(index + i));
+	if (index - i >= 0 && !dataset.deleted(index - i))
+	    imageCache->Prefetch(index - i, trainingImagePath + "/" + dataset.image(index - i), trainingLabelPath + "/" + dataset.label(index - i));
+    }
 }
 
 void deleteTrainingData(int index)
 {
-    string tempImageFileName = trainingImagePath + "/" + imageFileNames[index];
-    string tempLabelFileName = trainingLabelPath + "/" + labelFileNames[index];
+    string tempImageFileName = trainingImagePath + "/" + dataset.image(index);
+    string tempLabelFileName = trainingLabelPath + "/" + dataset.label(index);
 
     //cout << "imgFile = " << imgFileName <<  " labelFile = " << labelFileName << endl;
 
@@ -434,62 +429,99 @@ void deleteTrainingData(int index)
     // clear the regions list
     regions.clear();
 
-    // remove the names from the lists
-    imageFileNames.erase(imageFileNames.begin() + index);
-    labelFileNames.erase(labelFileNames.begin() + index);
+    // mark the sample deleted in the manifest, other indices stay valid
+    dataset.Delete(index);
+    imageCache->Erase(index);
 }
 
 void exportTrainingData(int index)
 {
-    string tempImageFileName = trainingImagePath + "/" + imageFileNames[index];
-    string tempLabelFileName = trainingLabelPath + "/" + labelFileNames[index];
+    string tempImageFileName = trainingImagePath + "/" + dataset.image(index);
+    string tempLabelFileName = trainingLabelPath + "/" + dataset.label(index);
 
     // save original image - Not needed to resave image file, just labels
     //imwrite(tempImageFileName.c_str(),src);
 
     // overwrite corresponding label file
     //cout << "tempLabelFileName = " << tempLabelFileName << endl;
-    ofstream outFile;
-    outFile.open(tempLabelFileName.c_str());
+    ostringstream labels;
     for (list<Region>::iterator list_iter = regions.begin(); list_iter != regions.end(); list_iter++)
     {
-      	outFile << (*list_iter).label << endl;
+      	labels << (*list_iter).label << endl;
     }	
+    ofstream outFile;
+    outFile.open(tempLabelFileName.c_str());
+    outFile << labels.str();
     outFile.close();
+    imageCache->Erase(index);
+
+    // a label file created by this save must not trigger a manifest rebuild
+    dataset.Stamp();
+
+    // put the image file as it is, without re-encoding, into the LMDBs
+    if (lmdbWriter)
+    {
+	ifstream imageFile(tempImageFileName.c_str(), ios::binary);
+	vector<uchar> image((istreambuf_iterator<char>(imageFile)), istreambuf_iterator<char>());
+	string name = boost::filesystem::path(tempImageFileName).stem().string();
+	lmdbWriter->Put(name, image, src.rows, src.cols, src.channels(), labels.str());
+    }
 
 }
 
 int main(int argc, char* argv[])
 {
+    // --lmdb <dir> also puts every re-saved sample into Caffe LMDBs in dir
+    string lmdbPath;
+    if (argc > 2 && string(argv[1]) == "--lmdb")
+    {
+	lmdbPath = argv[2];
+	argv[2] = argv[0];
+	argv += 2;
+	argc -= 2;
+    }
 
     if (argc != 4)
     {
-	cout << "Usage: " << argv[0] << " <trainingImagePath> <trainingLabelPath> <classes_file>" << endl;
+	cout << "Usage: " << argv[0] << " [--lmdb <dir>] <trainingImagePath> <trainingLabelPath> <classes_file>" << endl;
 	return 0;
     }
 
     trainingImagePath = argv[1];
-    imageFileNames = vector<string>();
-    if (getdir(trainingImagePath,imageFileNames) != 0)
+    trainingLabelPath = argv[2];
+
+    // pair images and labels through the manifest, rescanning only on change
+    if (!dataset.Open(trainingImagePath, trainingLabelPath))
     {
-	cout << "Error reading image files from " << trainingImagePath << endl;
+	cout << "Error indexing training files in " << trainingImagePath << " and " << trainingLabelPath << endl;
 	return -1;
     }
 
-    trainingLabelPath = argv[2];
-    labelFileNames = vector<string>();
-    if (getdir(trainingLabelPath,labelFileNames) != 0)
+    cout << "trainingImagePath = " << trainingImagePath << ": number of files = " << dataset.size() << endl;
+    cout << "trainingLabelPath = " << trainingLabelPath << endl;
+
+    // load first image and data
+    imgIndex = dataset.Next(-1, 1);
+    if (imgIndex < 0)
     {
-	cout << "Error reading label files from " << trainingLabelPath << endl;
+	cout << "No training images in " << trainingImagePath << endl;
 	return -1;
     }
 
-    cout << "trainingLabelPath = " << trainingLabelPath << ": number of files = " << imageFileNames.size() << endl;
-    cout << "trainingImagePath = " << trainingImagePath << ": number of files = " << labelFileNames.size() << endl;
-
     readInClasses(argv[3]);
     printClasses();
 
+    LmdbWriter lmdb(lmdbPath, std::vector<string>(classes.begin(), classes.end()), 256, 64);
+    if (!lmdbPath.empty())
+    {
+	if (!lmdb.Open())
+	{
+	    cout << "Built without LMDB support, rebuild with make WITH_LMDB=1" << endl;
+	    return -1;
+	}
+	lmdbWriter = &lmdb;
+    }
+
     cout<<"Left click to select region"<<endl;
     cout<<"Right click and drag to select & move existing region"<<endl;
     cout<<"--> Press number to create new region"<<endl;
@@ -502,8 +534,10 @@ int main(int argc, char* argv[])
     namedWindow(winName,CV_WINDOW_AUTOSIZE);
     setMouseCallback(winName,onMouse,NULL );
 
-    // load first image and data - after "." (0) and ".." (1)
-    imgIndex = 2;
+    // 2 threads decode up to 16 images around the current one
+    ImageCache cache(16, 2);
+    imageCache = &cache;
+
     importTrainingData(imgIndex);
 
     while(1){
@@ -520,8 +554,9 @@ int main(int argc, char* argv[])
 		    // 'd' advances to next training image
 		    if(c=='d')
 		    {
-			if (imgIndex < imageFileNames.size() - 1) {
-				importTrainingData(++imgIndex);
+			int next = dataset.Next(imgIndex, 1);
+			if (next >= 0) {
+				importTrainingData(imgIndex = next);
 				cout << "Training set #" << std::setbase(10) << imgIndex << endl;
 			}
 		    }
@@ -529,8 +564,9 @@ int main(int argc, char* argv[])
 		    // 'a' advances to prev training image
 		    if(c=='a')
 		    {
-			if (imgIndex > 2) {
-				importTrainingData(--imgIndex);
+			int prev = dataset.Next(imgIndex, -1);
+			if (prev >= 0) {
+				importTrainingData(imgIndex = prev);
 				cout << "Training set #" << std::setbase(10) << imgIndex << endl;
 			}
 		    }
@@ -551,11 +587,16 @@ int main(int argc, char* argv[])
 			// delete current training image & label files
 			deleteTrainingData(imgIndex);
 			
-			// load the previous image
-			if (imgIndex > 2) {
-				importTrainingData(--imgIndex);
-				cout << "Training set #" << std::setbase(10) << imgIndex << endl;
+			// load the previous image, or the next one at the start
+			int prev = dataset.Next(imgIndex, -1);
+			if (prev < 0)
+				prev = dataset.Next(imgIndex, 1);
+			if (prev < 0) {
+				cout << "No training sets left." << endl;
+				break;
 			}
+			importTrainingData(imgIndex = prev);
+			cout << "Training set #" << std::setbase(10) << imgIndex << endl;
 		    }
 
 		    // delete selected region
@@ -591,5 +632,8 @@ int main(int argc, char* argv[])
 
     }
 
+    lmdbWriter = NULL;
+    lmdb.Close();
+
     return 0;
 }
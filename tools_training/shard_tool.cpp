@@ -0,0 +1,165 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "boost/filesystem.hpp"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/shard.h"
+
+using namespace std;
+
+/* Reads and writes the packed shard files of the trainers' --shards
+ * export; see common/shard.h for the format. */
+
+static bool ReadFile(const string& path, string* contents) {
+  ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+  if (!file)
+    return false;
+  std::ostringstream buffer;
+  buffer << file.rdbuf();
+  *contents = buffer.str();
+  return true;
+}
+
+static bool WriteFile(const string& path, const string& contents) {
+  ofstream file(path.c_str(), std::ios::out | std::ios::binary);
+  file.write(contents.data(), contents.size());
+  file.close();
+  return !file.fail();
+}
+
+/* Pack the images of <data_dir>/images and the matching .txt files of
+ * <data_dir>/labels into shards, in file name order. Images are copied as
+ * they are, without decoding. */
+static int Convert(const string& data_dir, const string& out_dir,
+                   const string& prefix, uint64_t size_cap) {
+  namespace fs = boost::filesystem;
+  const fs::path image_dir = fs::path(data_dir) / "images";
+  const fs::path label_dir = fs::path(data_dir) / "labels";
+  if (!fs::is_directory(image_dir)) {
+    cout << "No images folder in " << data_dir << endl;
+    return 1;
+  }
+
+  std::vector<fs::path> images;
+  for (fs::directory_iterator it(image_dir), end; it != end; ++it)
+    if (fs::is_regular_file(it->path()))
+      images.push_back(it->path());
+  std::sort(images.begin(), images.end());
+
+  ShardWriter writer(out_dir, prefix, size_cap);
+  size_t converted = 0;
+  size_t unlabeled = 0;
+  for (size_t i = 0; i < images.size(); ++i) {
+    ShardRecord record;
+    record.name = images[i].filename().string();
+    if (!ReadFile(images[i].string(), &record.image)) {
+      cout << "Unable to read " << images[i].string() << endl;
+      continue;
+    }
+    string labels;
+    const string stem = images[i].stem().string();
+    if (!ReadFile((label_dir / (stem + ".txt")).string(), &labels))
+      ++unlabeled;
+    record.labels = EncodeLabels(labels);
+    if (!writer.Append(record)) {
+      cout << "Unable to write shards to " << out_dir << endl;
+      return 1;
+    }
+    ++converted;
+  }
+  writer.Close();
+
+  cout << "Packed " << converted << " samples (" << unlabeled
+       << " without labels) into " << writer.num_shards() << " shards in "
+       << out_dir << endl;
+  return 0;
+}
+
+/* Print one line per record of the given shards. */
+static int List(int num_shards, char** shards) {
+  for (int i = 0; i < num_shards; ++i) {
+    ShardReader reader;
+    if (!reader.Open(shards[i])) {
+      cout << "Not a shard: " << shards[i] << endl;
+      return 1;
+    }
+    cout << shards[i] << ": ";
+    if (reader.num_records())
+      cout << reader.num_records() << " records" << endl;
+    else
+      cout << "no index, reading sequentially" << endl;
+    ShardRecord record;
+    while (reader.Next(&record)) {
+      uint32_t objects = 0;
+      if (record.labels.size() >= sizeof(objects))
+        memcpy(&objects, record.labels.data(), sizeof(objects));
+      cout << record.name << " " << record.image.size() << " bytes, "
+           << objects << " objects" << endl;
+    }
+  }
+  return 0;
+}
+
+/* Unpack shards back into <out_dir>/images and <out_dir>/labels. Images
+ * keep the extension of their record name, or get the one of their
+ * format if the name has none. */
+static int Extract(int num_shards, char** shards, const string& out_dir) {
+  namespace fs = boost::filesystem;
+  const fs::path image_dir = fs::path(out_dir) / "images";
+  const fs::path label_dir = fs::path(out_dir) / "labels";
+  fs::create_directories(image_dir);
+  fs::create_directories(label_dir);
+
+  size_t extracted = 0;
+  for (int i = 0; i < num_shards; ++i) {
+    ShardReader reader;
+    if (!reader.Open(shards[i])) {
+      cout << "Not a shard: " << shards[i] << endl;
+      return 1;
+    }
+    ShardRecord record;
+    while (reader.Next(&record)) {
+      const string ext = ShardImageExtension(record.name, record.image);
+      string stem = record.name;
+      if (fs::path(stem).extension() == ext)
+        stem = fs::path(stem).stem().string();
+      if (!WriteFile((image_dir / (stem + ext)).string(), record.image) ||
+          !WriteFile((label_dir / (stem + ".txt")).string(),
+                     DecodeLabels(record.labels))) {
+        cout << "Unable to write " << record.name << " to " << out_dir
+             << endl;
+        return 1;
+      }
+      ++extracted;
+    }
+  }
+  cout << "Extracted " << extracted << " samples to " << out_dir << endl;
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    string command = argc > 1 ? argv[1] : "";
+
+    if (command == "convert" && (argc >= 4 && argc <= 6))
+	return Convert(argv[2], argv[3], argc > 4 ? argv[4] : "",
+		       (argc > 5 ? strtoull(argv[5], NULL, 10) : 256) << 20);
+
+    if (command == "list" && argc >= 3)
+	return List(argc - 2, argv + 2);
+
+    if (command == "extract" && argc >= 4)
+	return Extract(argc - 3, argv + 3, argv[2]);
+
+    cout << "Usage: " << argv[0] << " convert <training_data_dir> <shard_dir> [prefix] [shard_size_mb]" << endl;
+    cout << "       " << argv[0] << " list <file.shard>..." << endl;
+    cout << "       " << argv[0] << " extract <out_dir> <file.shard>..." << endl;
+    return 1;
+}
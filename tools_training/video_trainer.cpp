@@ -6,6 +6,20 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "common/frame_source.h"
+#include "common/export_writer.h"
 
 using namespace std;
 using namespace cv;
@@ -120,6 +134,8 @@ bool rightclicked=false;
 char imgName[15];
 
 
+ExportWriter* exportWriter = NULL;
+
 // Here, 'DontCare' labels denote regions in which objects have not been labeled,
 // for example because they have been too far away from the laser scanner. To
 // prevent such objects from being counted as false positives our evaluation
@@ -164,6 +180,14 @@ void showRegions(){
     else
 	putText(img,"TRAINING OFF",pt2,fontFace,1,cvScalar(0,255,0), 2 ,8, false);
 
+    // show export writer queue depth, dropped and failed samples
+    if (exportWriter)
+    {
+	char stats[64];
+	snprintf(stats,sizeof(stats),"queue %d dropped %d failed %d",(int)exportWriter->depth(),(int)exportWriter->dropped(),(int)exportWriter->failed());
+	putText(img,stats,Point(10,img.rows - 20),fontFace,1,cvScalar(0,255,255), 1 ,8, false);
+    }
+
     imshow(winName,img);
 
 }
@@ -385,9 +409,6 @@ void exportTrainingData()
     //char buf[32];
     //snprintf(buf,sizeof(buf),"_%d_%06d",(int)timeStamp.tv_sec,(int)timeStamp.tv_usec);
 
-    // check to make sure the folders are still there before exporting
-    prepTrainingFolders();
-
     char counterStr[6];
     sprintf(counterStr,"%06ld",frameCounter++);
 
@@ -401,40 +422,55 @@ void exportTrainingData()
 
     //cout << "imgFile = " << imgFileName <<  " labelFile = " << labelFileName << endl;
 
-    // save original image
-    imwrite(imgFileName.c_str(),src);
-
-    // save corresponding label file
-    ofstream outFile;
-    outFile.open(labelFileName.c_str());
+    // queue the original image and its label file for the export writer
+    ostringstream labels;
     for (list<Region>::iterator list_iter = regions.begin(); list_iter != regions.end(); list_iter++)
     {
-      	outFile << (*list_iter).label << endl;
-    }	
-    outFile.close();
+      	labels << (*list_iter).label << endl;
+    }
+    exportWriter->Push(imgFileName, src, labelFileName, labels.str());
 
 }
 
 int main(int argc, char* argv[])
 {
+    // --shards exports to packed shard files and --lmdb to Caffe LMDBs
+    // instead of a jpg and a txt per frame
+    bool shardExport = false;
+    bool lmdbExport = false;
+    for (int i = 1; i < argc; )
+    {
+	if (string(argv[i]) == "--shards")
+	    shardExport = true;
+	else if (string(argv[i]) == "--lmdb")
+	    lmdbExport = true;
+	else
+	{
+	    i++;
+	    continue;
+	}
+	for (int j = i; j < argc - 1; j++)
+	    argv[j] = argv[j + 1];
+	argc--;
+    }
 
-    if (argc != 4)
+    if (argc != 4 && argc != 5)
     {
-	cout << "Usage: " << argv[0] << " <filename | VIDEO> <classes_file> <training_file_prefix>" << endl;
+	cout << "Usage: " << argv[0] << " [--shards] [--lmdb] <filename | file.frames | VIDEO> <classes_file> <training_file_prefix> [record.frames]" << endl;
 	return 0;
     }
 
     videoFilename = argv[1];
-    VideoCapture vidCap;
+    FrameSource vidCap;
     cout << "videoFilename = " << videoFilename << endl;
-    if (videoFilename == "VIDEO")
-	vidCap = VideoCapture(0);
-    else
-	vidCap = VideoCapture(videoFilename);
-
-    //VideoCapture vidCap(videoFilename);
-    if (!vidCap.isOpened()) 
+    if (!vidCap.Open(videoFilename))
 	return -1;
+    vidCap.set_realtime(false);
+    if (argc == 5 && !vidCap.StartRecording(argv[4], true))
+    {
+	cout << "Unable to record to " << argv[4] << endl;
+	return -1;
+    }
 
     readInClasses(argv[2]);
     printClasses();
@@ -443,6 +479,18 @@ int main(int argc, char* argv[])
     cout << "trainingFilenamePrefix = " << trainingFilenamePrefix << endl;
     prepTrainingFolders();
 
+    // export training data from background threads, optionally to 256 MB shards
+    // and/or to LMDBs committed every 256 samples
+    ShardWriter shards("./training_data/shards", trainingFilenamePrefix, 256 << 20);
+    LmdbWriter lmdb("./training_data/lmdb", std::vector<string>(classes.begin(), classes.end()), 256, 64);
+    if (lmdbExport && !lmdb.Open())
+    {
+	cout << "Built without LMDB support, rebuild with make WITH_LMDB=1" << endl;
+	return -1;
+    }
+    ExportWriter writer(64, std::max(1u, std::thread::hardware_concurrency() / 2), shardExport ? &shards : NULL, lmdbExport ? &lmdb : NULL);
+    exportWriter = &writer;
+
     cout<<"Left click and drag to define region"<<endl;
     cout<<"Right click and drag to select & move existing region"<<endl;
     cout<<"--> Press number to create new region"<<endl;
@@ -521,5 +569,13 @@ int main(int argc, char* argv[])
 
     }
 
+    writer.Close();
+    shards.Close();
+    lmdb.Close();
+    cout << "Exported " << writer.written() << " samples, dropped " << writer.dropped() << ", failed " << writer.failed() << endl;
+    if (writer.failed())
+	cout << "Unable to export " << writer.last_failure() << endl;
+    exportWriter = NULL;
+
     return 0;
 }
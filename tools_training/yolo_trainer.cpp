@@ -7,6 +7,20 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "common/frame_source.h"
+#include "common/export_writer.h"
 
 using namespace std;
 using namespace cv;
@@ -83,6 +97,8 @@ bool rightclicked=false;
 char imgName[15];
 
 
+ExportWriter* exportWriter = NULL;
+
 // Here, 'DontCare' labels denote regions in which objects have not been labeled,
 // for example because they have been too far away from the laser scanner. To
 // prevent such objects from being counted as false positives our evaluation
@@ -128,6 +144,14 @@ void showRegions(){
     else
 	putText(img,"TRAINING OFF",pt2,fontFace,1,cvScalar(0,255,0), 2 ,8, false);
 
+    // show export writer queue depth, dropped and failed samples
+    if (exportWriter)
+    {
+	char stats[64];
+	snprintf(stats,sizeof(stats),"queue %d dropped %d failed %d",(int)exportWriter->depth(),(int)exportWriter->dropped(),(int)exportWriter->failed());
+	putText(img,stats,Point(10,img.rows - 20),fontFace,1,cvScalar(0,255,255), 1 ,8, false);
+    }
+
     imshow(winName,img);
 
 }
@@ -358,9 +382,6 @@ void exportTrainingData()
     //char buf[32];
     //snprintf(buf,sizeof(buf),"_%d_%06d",(int)timeStamp.tv_sec,(int)timeStamp.tv_usec);
 
-    // check to make sure the folders are still there before exporting
-    prepTrainingFolders();
-
     char counterStr[6];
     sprintf(counterStr,"%06ld",frameCounter++);
 
@@ -374,40 +395,55 @@ void exportTrainingData()
 
     //cout << "imgFile = " << imgFileName <<  " labelFile = " << labelFileName << endl;
 
-    // save original image
-    imwrite(imgFileName.c_str(),src);
-
-    // save corresponding label file
-    ofstream outFile;
-    outFile.open(labelFileName.c_str());
+    // queue the original image and its label file for the export writer
+    ostringstream labels;
     for (list<Region>::iterator list_iter = regions.begin(); list_iter != regions.end(); list_iter++)
     {
-      	outFile << (*list_iter).label << endl;
-    }	
-    outFile.close();
+      	labels << (*list_iter).label << endl;
+    }
+    exportWriter->Push(imgFileName, src, labelFileName, labels.str());
 
 }
 
 int main(int argc, char* argv[])
 {
+    // --shards exports to packed shard files and --lmdb to Caffe LMDBs
+    // instead of a jpg and a txt per frame
+    bool shardExport = false;
+    bool lmdbExport = false;
+    for (int i = 1; i < argc; )
+    {
+	if (string(argv[i]) == "--shards")
+	    shardExport = true;
+	else if (string(argv[i]) == "--lmdb")
+	    lmdbExport = true;
+	else
+	{
+	    i++;
+	    continue;
+	}
+	for (int j = i; j < argc - 1; j++)
+	    argv[j] = argv[j + 1];
+	argc--;
+    }
 
-    if (argc != 5)
+    if (argc != 5 && argc != 6)
     {
-	cout << "Usage: " << argv[0] << " <filename | VIDEO> <starting_frame> <classes_file> <training_file_prefix>" << endl;
+	cout << "Usage: " << argv[0] << " [--shards] [--lmdb] <filename | file.frames | VIDEO> <starting_frame> <classes_file> <training_file_prefix> [record.frames]" << endl;
 	return 0;
     }
 
     videoFilename = argv[1];
-    VideoCapture vidCap;
+    FrameSource vidCap;
     cout << "videoFilename = " << videoFilename << endl;
-    if (videoFilename == "VIDEO")
-	vidCap = VideoCapture(0);
-    else
-	vidCap = VideoCapture(videoFilename);
-
-    //VideoCapture vidCap(videoFilename);
-    if (!vidCap.isOpened()) 
+    if (!vidCap.Open(videoFilename))
 	return -1;
+    vidCap.set_realtime(false);
+    if (argc == 6 && !vidCap.StartRecording(argv[5], true))
+    {
+	cout << "Unable to record to " << argv[5] << endl;
+	return -1;
+    }
 
     string startingFrameStr = argv[2];
     startingFrame = stoi(startingFrameStr);
@@ -419,6 +455,18 @@ int main(int argc, char* argv[])
     cout << "trainingFilenamePrefix = " << trainingFilenamePrefix << endl;
     prepTrainingFolders();
 
+    // export training data from background threads, optionally to 256 MB shards
+    // and/or to LMDBs committed every 256 samples
+    ShardWriter shards("./yolo_training_data/shards", trainingFilenamePrefix, 256 << 20);
+    LmdbWriter lmdb("./yolo_training_data/lmdb", classes, 256, 64);
+    if (lmdbExport && !lmdb.Open())
+    {
+	cout << "Built without LMDB support, rebuild with make WITH_LMDB=1" << endl;
+	return -1;
+    }
+    ExportWriter writer(64, std::max(1u, std::thread::hardware_concurrency() / 2), shardExport ? &shards : NULL, lmdbExport ? &lmdb : NULL);
+    exportWriter = &writer;
+
     cout<<"Left click and drag to define region"<<endl;
     cout<<"Right click and drag to select & move existing region"<<endl;
     cout<<"--> Press number to create new region"<<endl;
@@ -433,7 +481,7 @@ int main(int argc, char* argv[])
     // zip forward to starting frame number (if using a file)
     if (videoFilename != "VIDEO") {
         cout << "seeking to frame #" << std::dec << startingFrame << endl;
- 	vidCap.set(CV_CAP_PROP_POS_FRAMES,(double) startingFrame);
+ 	vidCap.Seek(startingFrame);
     }
 
     while(1){
@@ -506,5 +554,13 @@ int main(int argc, char* argv[])
 
     }
 
+    writer.Close();
+    shards.Close();
+    lmdb.Close();
+    cout << "Exported " << writer.written() << " samples, dropped " << writer.dropped() << ", failed " << writer.failed() << endl;
+    if (writer.failed())
+	cout << "Unable to export " << writer.last_failure() << endl;
+    exportWriter = NULL;
+
     return 0;
 }